@@ -1,13 +1,16 @@
 #pragma once
 
 #ifdef DEBUG
-#include "utils/uartstdio.h"
-#include "screen.h"
-// #define debug(...) UARTdebug(__VA_ARGS__)
-#define debug(...) Screen::the_screen.debug_(__VA_ARGS__)
+#include "log.h"
+// formatted later, by Log::drain()
+#define debug(...) Log::record(__VA_ARGS__)
 #else
 #define debug(...) 
 #endif
 
+#ifdef __arm__
 #define assert(x) do {if(!(x)) for(;;);} while (0)
-
+#else
+#include <cstdlib>
+#define assert(x) do {if(!(x)) abort();} while (0)
+#endif
@@ -4,28 +4,92 @@
 #include "assert.h"
 #include "att.h"
 
-AttributeBase::AttributeBase(const UUID &t, void *d, uint16_t l) :
-  type(t), handle(++next_handle), _data(d), length(l)
+AttributeBase::AttributeBase(const UUID &t, const void *d, uint16_t l) :
+  type(t), handle(next_handle + 1), constant(false), _data(d), length(l), group_length(0)
 {
-  all_handles[handle] = this;
+  add_to_table();
 }
 
-AttributeBase::AttributeBase(int16_t t, void *d, uint16_t l) :
-  type(t), handle(++next_handle), _data(d), length(l)
+AttributeBase::AttributeBase(int16_t t, const void *d, uint16_t l) :
+  type(t), handle(next_handle + 1), constant(false), _data(d), length(l), group_length(0)
 {
-  all_handles[handle] = this;
+  add_to_table();
+}
+
+void AttributeBase::add_to_table() {
+  assert(handle <= capacity); // ATTRIBUTE_TABLE is too small
+
+  next_handle = handle;
+  all_handles[handle - 1] = this;
+  indexed = false;
+}
+
+void AttributeBase::add(const AttributeBase *records, uint16_t n) {
+  for (uint16_t i=0; i < n; ++i) {
+    assert(next_handle < capacity);       // ATTRIBUTE_TABLE is too small
+    assert(i + records[i].group_length < n); // a group can't leave its table
+
+    all_handles[next_handle++] = records + i;
+  }
+
+  indexed = false;
+}
+
+bool AttributeBase::precedes(uint16_t h1, uint16_t h2) {
+  int c = UUID::compare(at(h1)->type, get(h2)->type);
+  return c < 0 || (c == 0 && h1 < h2);
+}
+
+void AttributeBase::build_index() {
+  for (uint16_t i=0; i < next_handle; ++i) by_type[i] = i + 1;
+  std::sort(by_type, by_type + next_handle, precedes);
+  cursor = 0;
+  indexed = true;
+}
+
+/*
+ * Returns the first index entry whose type and handle are at least
+ * (type, start). Any other handles of the same type follow it.
+ */
+uint16_t *AttributeBase::lower_bound(const UUID &type, uint16_t start) {
+  if (!indexed) build_index();
+
+  uint16_t *first = by_type, *last = by_type + next_handle;
+
+  // discovery asks for the handle after the previous result, which is
+  // the next entry in the index
+  if (cursor && *cursor < start && at(*cursor)->type == type) {
+    uint16_t *next = cursor + 1;
+    if (next == last || *next >= start || at(*next)->type != type) {
+      if (next < last) cursor = next;
+      return next;
+    }
+  }
+
+  while (first < last) {
+    uint16_t *middle = first + (last - first)/2;
+    int c = UUID::compare(at(*middle)->type, type);
+
+    if (c < 0 || (c == 0 && *middle < start)) first = middle + 1;
+    else                                      last = middle;
+  }
+
+  if (first < by_type + next_handle) cursor = first;
+  return first;
 }
 
 uint16_t AttributeBase::find_by_type_value(uint16_t start, uint16_t type, void *value, uint16_t length) {
   assert(start > 0);
-  for (uint16_t i=start; i < next_handle; ++i) {
-    AttributeBase *attr = all_handles[i];
+  const UUID t(type);
+
+  for (uint16_t *i = lower_bound(t, start); i < by_type + next_handle; ++i) {
+    const AttributeBase *attr = at(*i);
 
-    if (attr->type != type) continue;
+    if (attr->type != t) break;
     if (length != attr->length) continue; // e.g., UUIDs could be either 2 or 16 bytes
     if (memcmp(attr->_data, value, length)) continue;
 
-    return i;
+    return *i;
   }
 
   return 0;
@@ -33,17 +97,13 @@ uint16_t AttributeBase::find_by_type_value(uint16_t start, uint16_t type, void *
 
 uint16_t AttributeBase::find_by_type(uint16_t start, const UUID &type) {
   assert(start > 0);
-  for (uint16_t i=start; i < next_handle; ++i) {
-    if (all_handles[i]->type == type) return i;
-  }
-  return 0;
-}
+  uint16_t *i = lower_bound(type, start);
 
-uint16_t AttributeBase::group_end() {
-  return handle;
+  if (i == by_type + next_handle || at(*i)->type != type) return 0;
+  return *i;
 }
 
-int AttributeBase::compare(void *data, uint16_t len, uint16_t min_handle, uint16_t max_handle) {
+int AttributeBase::compare(void *data, uint16_t len, uint16_t min_handle, uint16_t max_handle) const {
   if (handle < min_handle) return -1;
   if (handle > max_handle) return 1;
   return compare(data, len);
@@ -51,10 +111,10 @@ int AttributeBase::compare(void *data, uint16_t len, uint16_t min_handle, uint16
 
 #ifdef DEBUG
 void AttributeBase::dump_attributes() {
-  for (int i=1; i < next_handle; ++i) {
-    AttributeBase *attr = all_handles[i];
+  for (int i=1; i <= next_handle; ++i) {
+    const AttributeBase *attr = get(i);
 
-    debug("%04x %s: (%d) ", attr->handle, attr->type.pretty_print(), attr->length);
+    debug("%04x %s: (%d) ", i, attr->type.pretty_print(), attr->length);
     dump_hex_bytes((uint8_t *) attr->_data, attr->length);
     debug("\n");
   }
@@ -67,6 +127,25 @@ ATT_Channel::ATT_Channel(HostController &hc) :
 {
 }
 
+// sends as much of attribute h's value as fits in a notification
+bool ATT_Channel::notify(uint16_t connection, uint16_t h) {
+  const AttributeBase *attr = AttributeBase::get(h);
+  assert(attr != 0);
+
+  Packet *p = controller.acl_packets->allocate(att_mtu);
+  if (p == 0) return false;
+
+  p->l2cap(connection, channel_id).set_limit(att_mtu);
+  *p << (uint8_t) ATT::OPCODE_HANDLE_VALUE_NOTIFICATION << h;
+
+  rsp = p;
+  append_attribute(h, attr, 0, std::min(p->get_remaining(), attr->length));
+  rsp = 0;
+
+  send(p);
+  return true;
+}
+
 bool ATT_Channel::read_type() {
   switch (req->get_remaining()) {
   case 2 : {
@@ -76,9 +155,9 @@ bool ATT_Channel::read_type() {
     break;
   }
 
-  case 16 :
-    assert(sizeof(type.data) == 16);
-    req->read(type.data, sizeof(type.data));
+  case UUID::LENGTH :
+    req->read(full_type, sizeof(full_type));
+    type = UUID(full_type);
     break;
 
   default :
@@ -104,6 +183,37 @@ void ATT_Channel::error(uint8_t err) {
   rsp->l2cap() << (uint8_t) ATT::OPCODE_ERROR << req_opcode << h1 << err;  
 }
 
+void ATT_Channel::append_value(const void *data, uint16_t length, bool last, bool constant) {
+  /*
+   * A long constant value that ends the response is sent from the
+   * attribute's own storage instead of being copied into the packet. A
+   * variable could change while the response waits for the UART.
+   */
+  if (constant && last && length >= MIN_BORROWED_VALUE) rsp->borrow((const uint8_t *) data, length);
+  else                                      rsp->write((const uint8_t *) data, length);
+}
+
+void ATT_Channel::append_attribute(uint16_t h, const AttributeBase *attr, uint16_t offset, uint16_t length, bool last) {
+  const uint8_t *value = (const uint8_t *) attr->_data + offset;
+
+  if (attr->type != (uint16_t) GATT::CHARACTERISTIC) {
+    append_value(value, length, last, attr->constant);
+    return;
+  }
+
+  /*
+   * A characteristic declaration isn't stored with its value handle,
+   * which is always the next handle, so fill that in as it's copied.
+   */
+  uint8_t *p = *rsp;
+  rsp->write(value, length);
+
+  for (uint16_t i=offset; i < offset + length; ++i) {
+    if (i == 1) p[i - offset] = (uint8_t) (h + 1);
+    if (i == 2) p[i - offset] = (uint8_t) ((h + 1) >> 8);
+  }
+}
+
 bool ATT_Channel::is_grouping(const UUID &type) {
   return true;
 }
@@ -112,7 +222,7 @@ void ATT_Channel::find_information() {
   rsp = req; // re-use request packet
 
   const uint16_t short_info = sizeof(uint16_t) + sizeof(uint16_t);
-  const uint16_t long_info = sizeof(uint16_t) + sizeof(UUID);
+  const uint16_t long_info = sizeof(uint16_t) + UUID::LENGTH;
 
   uint16_t info_length = short_info;
 
@@ -123,7 +233,7 @@ void ATT_Channel::find_information() {
   *rsp << (uint8_t) 0; // format placeholder
 
   for (uint16_t h=h1; h <= h2 && rsp->get_remaining() >= info_length; ++h) {
-    AttributeBase *attr = AttributeBase::get(h);
+    const AttributeBase *attr = AttributeBase::get(h);
     assert(attr != 0);
 
     if (info_length == short_info) {
@@ -132,11 +242,14 @@ void ATT_Channel::find_information() {
         goto restart;
       }
 
-      *rsp << attr->handle;
+      *rsp << h;
       *rsp << (uint16_t) attr->type;
     } else {
-      *rsp << attr->handle;
-      rsp->write(attr->type.data, sizeof(attr->type.data));
+      uint8_t full[UUID::LENGTH];
+
+      attr->type.write(full);
+      *rsp << h;
+      rsp->write(full, sizeof(full));
     }
   }
 
@@ -167,16 +280,21 @@ void ATT_Channel::read_by_group_type() {
 
   for (; rsp->get_remaining() > 2*sizeof(uint16_t) + 1;) {
     if (h < h1 || h > h2) break;
-    AttributeBase *attr = AttributeBase::get(h);
+    const AttributeBase *attr = AttributeBase::get(h);
     if (attr_length == 0) { // first matching attribute
       attr_length = attr->length;
     } else if(attr_length != attr->length) { // stop if lengths differ
       break;
     }
 
-    *rsp << attr->handle << attr->group_end();
+    uint16_t end = attr->group_end(h);
+    *rsp << h << end;
     data_length = std::min(attr_length, rsp->get_remaining());
-    rsp->write((const uint8_t *) attr->_data, data_length);
+    append_attribute(h, attr, 0, data_length, rsp->get_remaining() <= data_length + 2*sizeof(uint16_t) + 1);
+
+    // the next group starts after this one ends
+    if (end >= h2) break;
+    h = AttributeBase::find_by_type(end + 1, type);
   }
   
   if (attr_length == 0) {
@@ -195,8 +313,14 @@ void ATT_Channel::find_by_type_value() {
   length = req->get_remaining(); // is this right?
 
   // can't re-use the request packet because we need the data at the end
-  rsp = controller.acl_packets->allocate();
-  assert(rsp != 0);
+  rsp = controller.acl_packets->allocate(att_mtu);
+
+  if (rsp == 0) {
+    // notifications can be holding every packet
+    error(ATT::INSUFFICIENT_RESOURCES);
+    return;
+  }
+
   rsp->l2cap(req, att_mtu); // re-use existing L2CAP framing from request
 
   *rsp << rsp_opcode;
@@ -213,7 +337,7 @@ void ATT_Channel::find_by_type_value() {
     if (h < h1 || h > h2 || (rsp->get_remaining() < 2*sizeof(uint16_t))) break;
 
     found_attribute_handle = h;
-    group_end_handle = AttributeBase::get(h)->group_end();
+    group_end_handle = AttributeBase::get(h)->group_end(h);
     uint16_t next_h = AttributeBase::find_by_type_value(h+1, short_type, value, length);
 
     if (found_attribute_handle == group_end_handle) { // not a grouping attribute
@@ -225,6 +349,7 @@ void ATT_Channel::find_by_type_value() {
   }
 
   if (found_attribute_handle == 0) {
+    rsp->deallocate();
     error(ATT::ATTRIBUTE_NOT_FOUND);
     return;
   }
@@ -245,8 +370,7 @@ void ATT_Channel::read_by_type() {
     h = AttributeBase::find_by_type(h, type);
     if (h < h1 || h > h2) break;
 
-    AttributeBase *attr = AttributeBase::get(h);
-    assert(h == attr->handle);
+    const AttributeBase *attr = AttributeBase::get(h);
 
     if (attr_length == 0) { // first matching attribute
       attr_length = attr->length;
@@ -257,7 +381,8 @@ void ATT_Channel::read_by_type() {
     }
 
     *rsp << h;
-    rsp->write((const uint8_t *) attr->_data, data_length - sizeof(uint16_t));
+    uint16_t value_length = data_length - sizeof(uint16_t);
+    append_attribute(h, attr, 0, value_length, rsp->get_remaining() - value_length < data_length);
     h += 1;
   } while (rsp->get_remaining() >= data_length);
   
@@ -268,7 +393,7 @@ void ATT_Channel::read_by_type() {
 }
 
 void ATT_Channel::receive(Packet *p) {
-  AttributeBase *attr = 0;
+  const AttributeBase *attr = 0;
 
   req = p;
   rsp = 0;
@@ -335,13 +460,13 @@ void ATT_Channel::receive(Packet *p) {
     } else {
       rsp = req;
       rsp->l2cap(att_mtu) << rsp_opcode;
-      rsp->write((uint8_t *) attr->_data, std::min(rsp->get_remaining(), attr->length));
+      append_attribute(h1, attr, 0, std::min(rsp->get_remaining(), attr->length));
     }
     break;
     
   case ATT::OPCODE_READ_BLOB_REQUEST :
     rsp_opcode = ATT::OPCODE_READ_BLOB_RESPONSE;
-    *req >> h1;
+    *req >> h1 >> offset;
 
     if (!(attr = AttributeBase::get(h1))) {
       error(ATT::INVALID_HANDLE);
@@ -354,7 +479,7 @@ void ATT_Channel::receive(Packet *p) {
       } else if (offset >= attr->length) {
         error(ATT::INVALID_OFFSET);
       } else {
-        rsp->write(((uint8_t *) attr->_data) + offset, std::min(rsp->get_remaining(), attr->length));
+        append_attribute(h1, attr, offset, std::min(rsp->get_remaining(), (uint16_t) (attr->length - offset)));
       }
     }
     break;
@@ -364,10 +489,7 @@ void ATT_Channel::receive(Packet *p) {
     break;
   }
 
-  if (rsp != 0) {
-    rsp->title = "response";
-    send(rsp);
-  }
+  if (rsp != 0) send(rsp);
 
   if (req != rsp) req->deallocate();
 
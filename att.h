@@ -6,26 +6,68 @@
 #include "ring.h"
 #include "packet.h"
 
-class AttributeBase : public Ring<AttributeBase> {
-  enum {MAX_ATTRIBUTES = 20};
+/*
+ * The attribute table is sized by the application, which knows how many
+ * attributes it constructs. It must appear in exactly one file, e.g.,
+ *
+ *   ATTRIBUTE_TABLE(sizeof(gatt_database)/sizeof(gatt_database[0]) + MyService::ATTRIBUTES);
+ *
+ * The storage is statically allocated and constant-initialized, so it's
+ * ready before any attribute's constructor runs.
+ */
+#define ATTRIBUTE_TABLE(n) \
+  static const AttributeBase *attribute_handles[n]; \
+  static uint16_t attribute_index[n]; \
+  const AttributeBase **const AttributeBase::all_handles = attribute_handles; \
+  uint16_t *const AttributeBase::by_type = attribute_index; \
+  const uint16_t AttributeBase::capacity = (n)
+
+/*
+ * An attribute is either an object constructed at run time, which takes
+ * the next handle, or a record in a const table (see gatt.h) that is
+ * laid out by the compiler and added to the table all at once. Records
+ * don't know their own handle, so anything that needs it is relative.
+ */
+class AttributeBase {
   static uint16_t next_handle;
-  static AttributeBase *all_handles[MAX_ATTRIBUTES];
+  static const AttributeBase **const all_handles; // handle h is at h-1
+  static const uint16_t capacity;
+
+  // handles sorted by type, then handle; rebuilt after construction
+  static uint16_t *const by_type;
+  static uint16_t *cursor; // the last lookup's result
+  static bool indexed;
+
+  void add_to_table();
+  static const AttributeBase *at(uint16_t h) {return all_handles[h - 1];}
+  static bool precedes(uint16_t h1, uint16_t h2);
+  static void build_index();
+  static uint16_t *lower_bound(const UUID &type, uint16_t start);
 
  public:
   UUID type;
-  uint16_t handle;
-  void *_data;
+  uint16_t handle;       // 0 for records
+  bool constant;         // _data never changes, so a response can borrow it
+  const void *_data;
   uint16_t length;
+  uint16_t group_length; // attributes that follow this one in its group
+
+  AttributeBase(const UUID &t, const void *d, uint16_t l);
+  AttributeBase(int16_t t, const void *d, uint16_t l);
 
-  AttributeBase(const UUID &t, void *d, uint16_t l);
-  AttributeBase(int16_t t, void *d, uint16_t l);
+  // a record in a const table
+  constexpr AttributeBase(uint16_t t, const void *d, uint16_t l, uint16_t group, bool c = true) :
+    type(t), handle(0), constant(c), _data(d), length(l), group_length(group)
+  {}
 
-  static AttributeBase *get(uint16_t h) {return (h < next_handle) ? all_handles[h] : 0;}
+  static const AttributeBase *get(uint16_t h) {return (h > 0 && h <= next_handle) ? all_handles[h - 1] : 0;}
+  static uint16_t count() {return next_handle;}
+  static void add(const AttributeBase *records, uint16_t n);
   static uint16_t find_by_type_value(uint16_t start, uint16_t type, void *value, uint16_t length);
   static uint16_t find_by_type(uint16_t start, const UUID &type);
-  int compare(void *data, uint16_t len);
-  int compare(void *data, uint16_t len, uint16_t min_handle, uint16_t max_handle);
-  virtual uint16_t group_end();
+  int compare(void *data, uint16_t len) const;
+  int compare(void *data, uint16_t len, uint16_t min_handle, uint16_t max_handle) const;
+  uint16_t group_end(uint16_t h) const {return h + group_length;}
 
   static void dump_attributes();
 };
@@ -46,14 +88,24 @@ class Attribute : public AttributeBase {
 template<>
 class Attribute<const char *> : public AttributeBase {
  public:
-  Attribute(const UUID &u) : AttributeBase(u, 0, 0) {}
-  Attribute(uint16_t u) : AttributeBase(u, 0, 0) {}
+  Attribute(const UUID &u) : AttributeBase(u, 0, 0) {constant = true;}
+  Attribute(uint16_t u) : AttributeBase(u, 0, 0) {constant = true;}
 
-  Attribute &operator=(const char *rhs) {_data = (void *) rhs; length = strlen(rhs); return *this;};
+  Attribute &operator=(const char *rhs) {_data = rhs; length = strlen(rhs); return *this;};
+};
+
+// adds a const table of records, in order, when constructed
+struct AttributeDatabase {
+  template<unsigned int n>
+  AttributeDatabase(const AttributeBase (&records)[n]) {AttributeBase::add(records, n);}
 };
 
 class ATT_Channel : public Channel {
+  enum {MIN_BORROWED_VALUE = 8}; // shorter values are cheaper to copy
+
   void error(uint8_t err);
+  void append_value(const void *data, uint16_t length, bool last, bool constant);
+  void append_attribute(uint16_t h, const AttributeBase *attr, uint16_t offset, uint16_t length, bool last = true);
   bool read_handles();
   bool read_type();
   bool is_grouping(const UUID &type);
@@ -69,12 +121,14 @@ class ATT_Channel : public Channel {
   uint8_t req_opcode, rsp_opcode;
   uint16_t h1, h2, offset;
   UUID type;
+  uint8_t full_type[UUID::LENGTH]; // storage for a type that isn't 16 bits
   Packet *req;
   Packet *rsp;
 
  public:
   ATT_Channel(HostController &hc);
   void receive(Packet *p);
+  bool notify(uint16_t connection, uint16_t h); // false if there's no packet
 };
 
 
@@ -272,6 +272,8 @@ namespace HCI {
     COMMAND(VS, 0x0336, PAN13XX_CHANGE_BAUD_RATE)
     COMMAND(VS, 0x010c, SLEEP_MODE_CONFIGURATIONS)
     COMMAND(VS, 0x0d2b, HCILL_PARAMETERS)
+    COMMAND(VS, 0x0304, READ_MEMORY)
+    COMMAND(VS, 0x0305, WRITE_MEMORY)
 
     COMMAND(LE, 0x0001, LE_SET_EVENT_MASK)
     COMMAND(LE, 0x0002, LE_READ_BUFFER_SIZE)
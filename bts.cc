@@ -3,10 +3,12 @@
 #include <iostream>
 #include <fstream>
 #include <iomanip>
+#include <algorithm>
 using namespace std;
 
 #include "bts.h"
 #include "hal.h"
+#include "lzss.h"
 
 namespace BTS {
   Script::Script(uint8_t *bytes, uint16_t length) :
@@ -60,6 +62,13 @@ namespace BTS {
       uint16_t action, length;
 
       script >> action >> length;
+
+      if (length > script.get_remaining()) {
+        script.skip(script.get_remaining());
+        error("truncated action");
+        return;
+      }
+
       command.initialize(start, length + sizeof(command_header));
       script.skip(length);
       command.seek(sizeof(command_header));
@@ -113,22 +122,97 @@ namespace BTS {
   SourceGenerator::SourceGenerator(const char *n, uint8_t *bytes, uint16_t length) :
     Script(bytes, length),
     name(n),
-    out(&cout)
+    out(&cout),
+    run_address(0),
+    run_writes(0)
   {
-    *out << "extern \"C\" const uint8_t " << name << "[] = {\n";
+    probe.baud = 115200;
+    probe.address = 0;
+    *out << "// " << name << endl;
   }
 
   SourceGenerator::SourceGenerator(const char *name) :
     Script(0, 0),
     name(name),
-    out(&cout)
+    out(&cout),
+    run_address(0),
+    run_writes(0)
   {
-    *out << "extern \"C\" const uint8_t " << name << "[] = {\n";
+    probe.baud = 115200;
+    probe.address = 0;
+    *out << "// " << name << endl;
+  }
+
+  // greedy LZSS, as LZSS expands it
+  static void compress(const vector<uint8_t> &in, vector<uint8_t> &out) {
+    size_t i = 0, flags_at = 0;
+    uint8_t bit = 8;
+
+    while (i < in.size()) {
+      if (bit == 8) {
+        flags_at = out.size();
+        out.push_back(0);
+        bit = 0;
+      }
+
+      size_t best = 0, distance = 0;
+
+      for (size_t j = i > LZSS::WINDOW ? i - LZSS::WINDOW : 0; j < i; ++j) {
+        size_t k = 0;
+        while (k < LZSS::MAX_MATCH && i + k < in.size() && in[j + k] == in[i + k]) ++k;
+        if (k >= best) {
+          best = k;
+          distance = i - j;
+        }
+      }
+
+      if (best >= LZSS::MIN_MATCH) {
+        uint16_t code = (distance - 1) | ((best - LZSS::MIN_MATCH) << LZSS::DISTANCE_BITS);
+        out[flags_at] |= 1 << bit;
+        out.push_back(code);
+        out.push_back(code >> 8);
+        i += best;
+      } else {
+        out.push_back(in[i++]);
+      }
+
+      bit += 1;
+    }
   }
 
   SourceGenerator::~SourceGenerator() {
+    vector<uint8_t> packed;
+
+    end_run();
+    compress(commands, packed);
+
+    // expand it again, just as the device will
+    LZSS check(&packed[0], packed.size());
+    vector<uint8_t> expanded(commands.size() + 1);
+    if (check.read(&expanded[0], expanded.size()) != commands.size() ||
+        !equal(commands.begin(), commands.end(), expanded.begin())) {
+      error("compressed script doesn't expand correctly\n");
+    }
+
+    *out << "// " << commands.size() << " bytes of commands, compressed to " << packed.size() << endl;
+    *out << "extern \"C\" const uint8_t " << name << "[] = {\n";
+    as_hex(&packed[0], packed.size(), "  ");
     *out << "};\n";
     *out << "extern \"C\" const uint32_t " << name << "_size = sizeof(" << name << ");\n";
+
+    if (!credits.empty()) {
+      // VirtualController answers with these, as the real controller did
+      *out << "#ifndef __arm__\n";
+      *out << "// opcode and Num_HCI_Command_Packets of each recorded Command Complete\n";
+      *out << "extern \"C\" const uint8_t " << name << "_credits[] = {\n" << hex << setfill('0');
+      for (map<uint16_t, uint8_t>::iterator i = credits.begin(); i != credits.end(); ++i) {
+        *out << "  0x" << setw(2) << (i->first & 0xff) << ", 0x" << setw(2) << (i->first >> 8)
+             << ", " << dec << (int) i->second << "," << hex << "\n";
+      }
+      *out << dec << "};\n";
+      *out << "extern \"C\" const uint32_t " << name << "_credits_size = sizeof(" << name << "_credits);\n";
+      *out << "#endif\n";
+    }
   }
 
   void SourceGenerator::emit(const uint8_t *bytes, uint16_t size) {
@@ -161,35 +245,90 @@ namespace BTS {
   }
 
   void SourceGenerator::send(Packet &action) {
-    command_header ch = {SEND_COMMAND, action.get_remaining()};
-
     uint16_t pos = action.tell();
 
     uint8_t indicator;
+    uint16_t opcode = 0;
     bool omitted = false;
 
     action >> indicator;
 
     if (indicator == COMMAND_PACKET) {
-      uint16_t opcode;
       action >> opcode;
 
       if (omit_opcode(opcode)) {
         omitted = true;
-        *out << "/* omitting \n";
+        *out << "// omitting:\n";
       }
     }
 
     action.rewind(pos);
-    as_hex((uint8_t *) action, action.get_remaining(), "  ");
+    as_hex((uint8_t *) action, action.get_remaining(), "// ");
+    *out << endl;
+
+    if (omitted) return;
 
-    if (omitted) {
-      *out << " */";
+    const uint8_t *bytes = (uint8_t *) action;
+    uint16_t size = action.get_remaining();
+
+    if (indicator == COMMAND_PACKET && opcode == OPCODE_PAN13XX_CHANGE_BAUD_RATE && size == 4 + 4) {
+      probe.baud = bytes[4] + (bytes[5] << 8) + (bytes[6] << 16) + (bytes[7] << 24);
     }
-    *out << endl;
+
+    if (indicator == COMMAND_PACKET && opcode == OPCODE_WRITE_MEMORY &&
+        size > 4 + WRITE_MEMORY_HEADER && bytes[3] == WRITE_MEMORY_HEADER + bytes[8]) {
+      const uint8_t *params = bytes + 4;
+      uint32_t address = params[0] + (params[1] << 8) + (params[2] << 16) + (params[3] << 24);
+
+      if (address != run_address + run.size()) end_run();
+      if (run.empty()) run_address = address;
+      run.insert(run.end(), params + WRITE_MEMORY_HEADER, params + WRITE_MEMORY_HEADER + params[4]);
+      run_writes += 1;
+
+      probe.address = address;
+      probe.bytes.assign(params + WRITE_MEMORY_HEADER,
+                         params + WRITE_MEMORY_HEADER + min((int) params[4], (int) PROBE_LENGTH));
+    } else {
+      end_run();
+      commands.insert(commands.end(), bytes, bytes + size);
+    }
+  }
+
+  // adds the pending memory writes, repacked into full commands
+  void SourceGenerator::end_run() {
+    uint32_t n = 0;
+
+    for (size_t i=0; i < run.size(); i += WRITE_MEMORY_MAX, ++n) {
+      uint8_t length = min(run.size() - i, (size_t) WRITE_MEMORY_MAX);
+      uint32_t address = run_address + i;
+      const uint8_t header[] = {
+        COMMAND_PACKET,
+        (uint8_t) OPCODE_WRITE_MEMORY, (uint8_t) (OPCODE_WRITE_MEMORY >> 8),
+        (uint8_t) (WRITE_MEMORY_HEADER + length),
+        (uint8_t) address, (uint8_t) (address >> 8), (uint8_t) (address >> 16), (uint8_t) (address >> 24),
+        length
+      };
+
+      commands.insert(commands.end(), header, header + sizeof(header));
+      commands.insert(commands.end(), run.begin() + i, run.begin() + i + length);
+    }
+
+    if (n < run_writes) {
+      *out << "// merged " << run_writes << " writes to 0x" << hex << run_address << dec
+           << " into " << n << endl;
+    }
+
+    run.clear();
+    run_writes = 0;
   }
 
   void SourceGenerator::expect(uint32_t msec, Packet &action) {
+    const uint8_t *event = (uint8_t *) action;
+
+    if (action.get_remaining() >= 6 && event[0] == HCI::EVENT_PACKET && event[1] == HCI::EVENT_COMMAND_COMPLETE) {
+      credits[event[4] + (event[5] << 8)] = event[3];
+    }
+
     *out << "// within " << msec << " msec expect:" << endl;
     as_hex((uint8_t *) action, action.get_remaining(), "// ");
     *out << endl;
@@ -225,6 +364,139 @@ namespace BTS {
     cerr << msg;
     exit(1);
   }
+
+  Report::Report(const char *f, uint8_t *bytes, uint16_t length) :
+    Script(bytes, length),
+    file(f),
+    awaiting(false),
+    previous_opcode(0),
+    errors(0),
+    commands(0),
+    command_bytes(0),
+    event_bytes(0),
+    writes(0),
+    merged_writes(0),
+    run_end(0),
+    run_bytes(0),
+    baud(115200),
+    scripted_seconds(0)
+  {
+  }
+
+  void Report::header(script_header &h) {
+    Script::header(h);
+    if (errors) script.skip(script.get_remaining()); // not a script at all
+  }
+
+  // 8N1, so ten bits a byte
+  void Report::transfer(uint32_t bytes) {
+    scripted_seconds += bytes*10.0/baud;
+  }
+
+  void Report::end_run() {
+    merged_writes += (run_bytes + WRITE_MEMORY_MAX - 1)/WRITE_MEMORY_MAX;
+    run_bytes = 0;
+  }
+
+  void Report::send(Packet &action) {
+    const uint8_t *bytes = (uint8_t *) action;
+    uint16_t size = action.get_remaining();
+    char reason[80];
+
+    if (awaiting) {
+      snprintf(reason, sizeof(reason), "no WAIT_EVENT before the command after 0x%04x", previous_opcode);
+      error(reason);
+    }
+
+    if (size < 4 || bytes[0] != HCI::COMMAND_PACKET || bytes[3] + 4 != size) {
+      error("malformed command");
+      return;
+    }
+
+    uint16_t opcode = bytes[1] + (bytes[2] << 8);
+    const uint8_t *params = bytes + 4;
+
+    previous_opcode = opcode;
+    commands += 1;
+    command_bytes += size;
+    transfer(size);
+    awaiting = true;
+
+    if (opcode != OPCODE_WRITE_MEMORY) {
+      end_run();
+      return;
+    }
+
+    uint32_t address = params[0] + (params[1] << 8) + (params[2] << 16) + (params[3] << 24);
+    uint8_t length = params[4];
+
+    if (bytes[3] != WRITE_MEMORY_HEADER + length) {
+      error("memory write length doesn't match the command's");
+      return;
+    }
+
+    writes += 1;
+    if (run_bytes == 0 || address != run_end) end_run();
+    run_bytes += length;
+    run_end = address + length;
+  }
+
+  void Report::expect(uint32_t msec, Packet &action) {
+    const uint8_t *event = (uint8_t *) action;
+    uint16_t size = action.get_remaining();
+    uint16_t opcode = 0;
+    char reason[80];
+
+    if (size < 3 || event[0] != HCI::EVENT_PACKET || event[2] + 3 != size) {
+      error("malformed event");
+      return;
+    }
+
+    if (event[1] == HCI::EVENT_COMMAND_COMPLETE && size >= 6) {
+      opcode = event[4] + (event[5] << 8);
+    } else if (event[1] == HCI::EVENT_COMMAND_STATUS && size >= 7) {
+      opcode = event[5] + (event[6] << 8);
+    }
+
+    if (!awaiting) {
+      error("WAIT_EVENT without a command");
+    } else if (opcode != last_opcode) {
+      snprintf(reason, sizeof(reason), "command 0x%04x waits for event 0x%02x (opcode 0x%04x)",
+               last_opcode, event[1], opcode);
+      error(reason);
+    }
+
+    event_bytes += size;
+    transfer(size);
+    awaiting = false;
+  }
+
+  void Report::configure(uint32_t b, flow_control control) {
+    baud = b;
+  }
+
+  void Report::error(const char *reason) {
+    cerr << file << ": " << reason << endl;
+    errors += 1;
+  }
+
+  bool Report::print() {
+    const uint32_t rates[] = {115200, 921600, 2000000, 3000000, 4000000};
+
+    if (awaiting) error("the last command has no WAIT_EVENT");
+    end_run();
+
+    printf("%s: %u commands, %u bytes sent, %u bytes of events, %u errors\n",
+           file, commands, command_bytes, event_bytes, errors);
+    printf("     %u memory writes, %u if contiguous ones are merged\n", writes, merged_writes);
+    printf("     upload as scripted: %.3f s\n", scripted_seconds);
+
+    for (size_t i=0; i < sizeof(rates)/sizeof(rates[0]); ++i) {
+      printf("     upload at %7u baud: %.3f s\n", rates[i], (command_bytes + event_bytes)*10.0/rates[i]);
+    }
+
+    return errors == 0;
+  }
 };
 
 
@@ -242,29 +514,44 @@ void file_as_bytes(const char *file, uint8_t *&value, size_t &size) {
     value = new uint8_t[size];
     bts_file.read((char *) value, size);
   }
-}
 
-void oem_cc2564_script() {
-  const char *file = "bluetooth_init_cc2564_2.1.bts";
+  if (value == 0 || size == 0 || size > 0xffff) {
+    cerr << "couldn't load " << file << endl;
+    exit(1);
+  }
+}
 
+// updates probe if the script changes the baud rate or writes memory
+void oem_script(const char *file, const char *name, BTS::Probe &probe) {
   uint8_t *raw_patch;
   size_t raw_patch_size;
 
   file_as_bytes(file, raw_patch, raw_patch_size);
 
-  if (raw_patch == 0 || raw_patch_size == 0) {
-    cerr << "couldn't load " << file << endl;
-    exit(1);
-  }
-
-  BTS::SourceGenerator code("bluetooth_init_cc2564", raw_patch, raw_patch_size);
-  SizedPacket<259> p;
-
+  BTS::SourceGenerator code(name, raw_patch, raw_patch_size);
+  code.probe = probe;
 
   // send OEM patch
   code.comment(file);
   code.emit(raw_patch, raw_patch_size);
-  delete raw_patch;
+  delete [] raw_patch;
+
+  probe = code.probe;
+}
+
+bool report(const char *file) {
+  uint8_t *bytes;
+  size_t size;
+
+  file_as_bytes(file, bytes, size);
+
+  BTS::Report r(file, bytes, size);
+  r.reset(bytes, size);
+  while (!r.is_complete()) r.play_next_action();
+  bool ok = r.print();
+
+  delete [] bytes;
+  return ok;
 }
 
 void cold_boot_script() {
@@ -363,6 +650,20 @@ void warm_boot_script() {
   p.prepare_for_tx();
   code.send(p);
 
+  code.comment("host buffer size (filled in when sent)");
+  p.hci(HCI::OPCODE_HOST_BUFFER_SIZE);
+  p << (uint16_t) 0; // ACL data packet length
+  p << (uint8_t) 0;  // synchronous data packet length
+  p << (uint16_t) 0; // total ACL data packets
+  p << (uint16_t) 0; // total synchronous data packets
+  p.prepare_for_tx();
+  code.send(p);
+
+  code.comment("controller to host flow control for ACL data");
+  p.hci(HCI::OPCODE_SET_CONTROLLER_TO_HOST_FLOW_CONTROL) << (uint8_t) 0x01;
+  p.prepare_for_tx();
+  code.send(p);
+
   code.comment("le read supported states");
   p.hci(HCI::OPCODE_LE_READ_SUPPORTED_STATES);
   p.prepare_for_tx();
@@ -470,16 +771,66 @@ void warm_boot_script() {
   code.send(p);
 }
 
-int main(int argc, char *argv[]) {
-  if (argc < 3) {
-    cerr << "usage: bts <bts file> <decl name>\n";
+void usage() {
+  cerr << "usage: bts {<bts file> <decl name>}...   generates source for the device\n";
+  cerr << "       bts -r <bts file>...               checks and reports on scripts\n";
+  exit(1);
+}
+
+// checks whether the controller still has its patch, after resetting it
+void warm_restart_script(const BTS::Probe &probe) {
+  BTS::SourceGenerator code("warm_restart");
+  SizedPacket<259> p;
+
+  if (probe.bytes.empty()) {
+    cerr << "the service pack writes no memory to probe\n";
     exit(1);
   }
 
+  code.comment("Reset Pan13XX, which keeps its patch and baud rate");
+  p.hci(HCI::OPCODE_RESET);
+  p.prepare_for_tx();
+  code.send(p);
+
+  code.comment("Read back the end of the patch");
+  p.hci(HCI::OPCODE_READ_MEMORY) << probe.address << (uint8_t) probe.bytes.size();
+  p.prepare_for_tx();
+  code.send(p);
+
+  cout << "extern \"C\" const uint32_t warm_restart_baud = " << probe.baud << ";\n";
+  cout << "extern \"C\" const uint8_t warm_restart_probe[] = {";
+  cout << hex << setfill('0');
+  for (size_t i=0; i < probe.bytes.size(); ++i) cout << (i ? ", " : "") << "0x" << setw(2) << (int) probe.bytes[i];
+  cout << dec << "};\n";
+  cout << "extern \"C\" const uint32_t warm_restart_probe_size = sizeof(warm_restart_probe);\n";
+}
+
+int main(int argc, char *argv[]) {
+  if (argc > 2 && strcmp(argv[1], "-r") == 0) {
+    bool ok = true;
+
+    for (int i=2; i < argc; ++i) {
+      if (!report(argv[i])) ok = false;
+    }
+
+    return ok ? 0 : 1;
+  }
+
+  if (argc < 3 || argc % 2 != 1 || argv[1][0] == '-') usage();
+
   cout << "#include <stdint.h>\n";
 
-  oem_cc2564_script();
+  /*
+   * Service packs are uploaded in the order they're given, so the probe
+   * reads back the last memory written by any of them.
+   */
+  BTS::Probe probe;
+  probe.baud = 115200;
+  probe.address = 0;
+
+  for (int i=1; i < argc; i += 2) oem_script(argv[i], argv[i + 1], probe);
   cold_boot_script();
   warm_boot_script();
+  warm_restart_script(probe);
 }
 #endif
@@ -1,6 +1,8 @@
 #ifndef __arm__
 #pragma once
 
+#include <vector>
+#include <map>
 #include "assert.h"
 #include "packet.h"
 #include "script.h"
@@ -50,6 +52,12 @@ namespace BTS {
       uint32_t control;
     } configuration;
 
+    // HCI_VS_Write_Memory parameters: address, length, then the data
+    enum {
+      WRITE_MEMORY_HEADER = 5,
+      WRITE_MEMORY_MAX = 255 - WRITE_MEMORY_HEADER
+    };
+
 
     Script(uint8_t *bytes, uint16_t length);
     virtual void reset(const uint8_t *bytes, uint16_t length);
@@ -66,14 +74,66 @@ namespace BTS {
     virtual void done();
   };
 
+  // how to recognize a controller that's already running a service pack
+  struct Probe {
+    uint32_t baud;                // it's left at
+    uint32_t address;             // of the last memory it writes
+    std::vector<uint8_t> bytes;   // the start of what's written there
+  };
+
+  /*
+   * Checks that every command in a script waits for the event that
+   * completes it, and totals the commands and bytes it sends, how many
+   * commands merging contiguous memory writes would save, and how long
+   * uploading it would take at several baud rates.
+   */
+  class Report : public Script {
+  protected:
+    const char *file;
+    bool awaiting; // the last command hasn't had its WAIT_EVENT yet
+    uint16_t previous_opcode; // of the last command, since last_opcode is already the next one's
+    uint32_t errors;
+    uint32_t commands, command_bytes, event_bytes, writes;
+    uint32_t merged_writes, run_end, run_bytes; // contiguous writes, repacked
+    uint32_t baud;          // as the script sets it
+    double scripted_seconds; // upload time at the script's baud rates
+
+    void end_run();
+    void transfer(uint32_t bytes);
+
+  public:
+    Report(const char *file, uint8_t *bytes, uint16_t length);
+
+    virtual void header(script_header &h);
+    virtual void send(Packet &action);
+    virtual void expect(uint32_t msec, Packet &action);
+    virtual void configure(uint32_t baud, flow_control control);
+    virtual void error(const char *reason);
+    bool print(); // false if the script has errors
+  };
+
+  /*
+   * Writes the commands a script sends as a compressed array for
+   * CannedScript, preceded by a listing of them in comments. Memory
+   * writes to contiguous addresses are merged into as few commands as
+   * will hold them.
+   */
   class SourceGenerator : public Script {
   protected:
     ostream *out;
     const char *name;
+    std::vector<uint8_t> commands;
+    std::vector<uint8_t> run;  // data of contiguous memory writes not yet added
+    uint32_t run_address, run_writes;
+    std::map<uint16_t, uint8_t> credits; // Num_HCI_Command_Packets by opcode, as recorded
 
     void as_hex(const uint8_t *bytes, uint16_t size, const char *start = 0);
+    void end_run();
 
   public:
+    enum {PROBE_LENGTH = 8};
+    Probe probe;
+
     SourceGenerator(const char *name, uint8_t *bytes, uint16_t length);
     SourceGenerator(const char *name);
     ~SourceGenerator();
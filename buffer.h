@@ -1,6 +1,7 @@
 #pragma once
 
 #include <cstdlib>
+#include <cstddef>
 #include <stdint.h>
 #include "assert.h"
 
@@ -66,13 +67,13 @@ class RingBuffer {
     if (write_position >= read_position) {
       return (size_t) (write_position - read_position);
     } else {
-      return (size_t) ((limit - read_position) + write_position);
+      return (size_t) ((limit - read_position) + (write_position - storage));
     }
   }
 
   size_t write_capacity() const {
     if (write_position >= read_position) {
-      return (size_t) ((limit - write_position) + read_position);
+      return (size_t) ((limit - write_position) + (read_position - storage) - 1);
     } else {
       return (size_t) ((read_position - write_position) - 1);
     }
@@ -137,6 +138,7 @@ class RingBuffer {
 
       if (write_position >= read_position) {
         run = limit - write_position;
+        if (read_position == storage) run -= 1; // don't wrap onto the reader
       } else {
         run = (read_position - write_position) - 1;
       }
@@ -1,6 +1,7 @@
 #include <stdint.h>
 #include <cstddef>
 #include "assert.h"
+#include "critical.h"
 
 extern "C" uint8_t __heap_start__;
 extern "C" uint8_t __heap_end__;
@@ -14,10 +15,9 @@ void *allocate_heap_space(size_t size) {
   }
 
   assert((unused_heap + size) < &__heap_end__);
-  __asm ("cpsie i");
+  CriticalSection masked;
   void *value = (void *) unused_heap;
   unused_heap += size;
-  __asm ("cpsid i");
   return value;
 }
 
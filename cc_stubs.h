@@ -1,8 +1,14 @@
 #pragma once
 
+#include <stddef.h>
+
+#ifdef __arm__
 extern "C" {
   void * memcpy(void * dst, void const * src, size_t len);
   int memcmp(const void *x0, const void *y0, size_t len);
   unsigned int strlen(const char *p0);
   char *strncpy(char *dst, const char *src, size_t len);
 };
+#else
+#include <cstring>
+#endif
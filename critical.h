@@ -0,0 +1,27 @@
+#pragma once
+
+#include <stdint.h>
+#include "hal.h"
+
+/*
+ * Holds off interrupts while it's in scope, and then puts PRIMASK back
+ * the way it found it. Unlike a bare cpsid/cpsie pair, these nest: a pool
+ * used from inside another critical section, or from an ISR, doesn't
+ * unmask interrupts behind its caller's back. On the host, the masking
+ * goes through the NVIC model, so it shows up in its histogram.
+ */
+class CriticalSection {
+#ifdef __arm__
+  uint32_t primask;
+
+ public:
+  CriticalSection() {asm volatile ("mrs %0, primask\n\tcpsid i" : "=r" (primask) : : "memory");}
+  ~CriticalSection() {asm volatile ("msr primask, %0" : : "r" (primask) : "memory");}
+#else
+  const bool was_masked;
+
+ public:
+  CriticalSection() : was_masked(CPU::set_master_interrupt_enable(false)) {}
+  ~CriticalSection() {CPU::set_master_interrupt_enable(!was_masked);}
+#endif
+};
@@ -1,15 +1,25 @@
 #pragma once
 
 #ifdef DEBUG
-//#include "utils/uartstdio.h"
-#include "screen.h"
+#include "assert.h"
 
+// eight bytes to a message, since each message takes a slot in the log
 inline void dump_hex_bytes(uint8_t *p, unsigned int len) {
-  if (len) debug("  ");
+  extern const char hex_digits[16];
+  char chunk[8*3 + 1];
 
-  for (unsigned int i=0; i < len; ++i) {
-    debug("%02x ", *p++);
-    if (i > 15 && (0xf & i) == 0) debug("\n  ");
+  for (unsigned int i=0; i < len; i += 8) {
+    char *c = chunk;
+
+    for (unsigned int j=i; j < len && j < i + 8; ++j) {
+      *c++ = hex_digits[p[j] >> 4];
+      *c++ = hex_digits[p[j] & 0x0f];
+      *c++ = ' ';
+    }
+    *c = 0;
+
+    // sixteen to a line
+    debug(i == 0 ? "  %s" : (i % 16 == 0 ? "\n  %s" : "%s"), chunk);
   }
 }
 #endif
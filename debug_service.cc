@@ -0,0 +1,11 @@
+#include "debug_service.h"
+
+#ifdef DEBUG
+PoolStatistics::Record DebugService::pool_statistics[REPORTED_POOLS];
+
+const AttributeBase DebugService::attributes[ATTRIBUTES] = {
+  GATT::primary_service<SERVICE, 2>(),
+  GATT::characteristic<GATT::READ, POOL_STATISTICS>(),
+  GATT::characteristic_value(POOL_STATISTICS, pool_statistics)
+};
+#endif
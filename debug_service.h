@@ -0,0 +1,30 @@
+#pragma once
+
+#include "gatt.h"
+#include "pool.h"
+
+#ifdef DEBUG
+/*
+ * Pool occupancy, for sizing the pools from the field: one
+ * PoolStatistics::Record per pool, refreshed by the main loop. All of
+ * it takes Read Blob requests, since a record is 22 bytes. The
+ * application adds the service where it wants it,
+ *
+ *   AttributeDatabase debug_attributes(DebugService::attributes);
+ */
+struct DebugService {
+  enum {SERVICE = 0xffe0, POOL_STATISTICS = 0xffe1, REPORTED_POOLS = 8};
+  enum {ATTRIBUTES = 3};
+
+  static PoolStatistics::Record pool_statistics[REPORTED_POOLS];
+  static const AttributeBase attributes[ATTRIBUTES];
+
+  // once per pass of the main loop
+  static void refresh() {PoolStatistics::snapshot(pool_statistics, REPORTED_POOLS);}
+};
+#else
+struct DebugService {
+  enum {ATTRIBUTES = 0};
+  static void refresh() {}
+};
+#endif
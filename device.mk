@@ -31,6 +31,8 @@ CFLAGS += -I$(TI_CMSIS)/Include -I$(ARM_CMSIS)/Include -I$(STELLARIS)/inc
 CFLAGS += -I$(STELLARISWARE)
 CFLAGS += -mcpu=cortex-m3 -mthumb -g -Dgcc -DPART_LM3S9D96 -fms-extensions -Wall
 CFLAGS += -DDEBUG=1
+# CFLAGS += -DTRACE # see trace.h
+# CFLAGS += -DSNOOP # see snoop.h
 CFLAGS += -Wno-pmf-conversions -Wno-psabi -std=gnu++0x
 
 LDFLAGS = --gc-sections -nostdlib -fno-builtin -nostartfiles -nodefaultlibs -T lm3s9d96.ld
@@ -1,5 +1,24 @@
 #include "gatt.h"
 
+/*
+ * The GAP and GATT services never change, so they're laid out in flash.
+ * Only the values that do change (or could) are kept in RAM.
+ */
+uint16_t GATT::appearance = 0;
+uint16_t GATT::service_changed[2] = {0, 0};
+
+const AttributeBase GATT::standard_services[GATT::STANDARD_ATTRIBUTES] = {
+  GATT::primary_service<GATT::GENERIC_ACCESS_PROFILE, 4>(),
+  GATT::characteristic<GATT::READ, GATT::DEVICE_NAME>(),
+  GATT::characteristic_value(GATT::DEVICE_NAME, "Test Dev 1"),
+  GATT::characteristic<GATT::READ, GATT::APPEARANCE>(),
+  GATT::characteristic_value(GATT::APPEARANCE, GATT::appearance),
+
+  GATT::primary_service<GATT::GENERIC_ATTRIBUTE_PROFILE, 2>(),
+  GATT::characteristic<GATT::INDICATE | GATT::WRITE_WITHOUT_RESPONSE | GATT::READ, GATT::SERVICE_CHANGED>(),
+  GATT::characteristic_value(GATT::SERVICE_CHANGED, GATT::service_changed)
+};
+
 CharacteristicDecl::CharacteristicDecl(uint16_t uuid) :
   AttributeBase(GATT::CHARACTERISTIC, &_decl, sizeof(_decl))
 {
@@ -14,30 +33,12 @@ CharacteristicDecl::CharacteristicDecl(const UUID &uuid) :
 {
   _decl.properties = 0;
   _decl.handle = 0;
-  memcpy(_decl.full_uuid, (const uint8_t *) uuid, sizeof(UUID));
-  length = sizeof(uint8_t) + sizeof(uint16_t) + sizeof(UUID);
-}
-
-GATT_Service::GATT_Service() :
-  Attribute<uint16_t>(GATT::PRIMARY_SERVICE, GATT::GENERIC_ATTRIBUTE_PROFILE),
-  changed(GATT::SERVICE_CHANGED)
-{
-  changed._decl.properties = GATT::INDICATE | GATT::WRITE_WITHOUT_RESPONSE | GATT::READ;
-}
-
-uint16_t GATT_Service::group_end() {
-  return changed.handle;
-}
-
-GAP_Service::GAP_Service(const char *name, uint16_t a) :
-  Attribute<uint16_t>(GATT::PRIMARY_SERVICE, GATT::GENERIC_ACCESS_PROFILE),
-  device_name(GATT::DEVICE_NAME),
-  appearance(GATT::APPEARANCE)
-{
-  appearance = a;
-  device_name = name;
-}
 
-uint16_t GAP_Service::group_end() {
-  return appearance.handle;
+  if (uuid.is_16bit()) {
+    _decl.short_uuid = (uint16_t) uuid;
+    length = sizeof(uint8_t) + sizeof(uint16_t) + sizeof(uint16_t);
+  } else {
+    uuid.write(_decl.full_uuid);
+    length = sizeof(uint8_t) + sizeof(uint16_t) + UUID::LENGTH;
+  }
 }
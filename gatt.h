@@ -1,5 +1,7 @@
 #pragma once
 
+#include <type_traits>
+
 #include "att.h"
 
 struct CharacteristicDecl : public AttributeBase {
@@ -7,7 +9,7 @@ struct CharacteristicDecl : public AttributeBase {
     uint8_t properties;
     uint16_t handle;
     union {
-      uint8_t full_uuid[sizeof(UUID)];
+      uint8_t full_uuid[UUID::LENGTH];
       uint16_t short_uuid;
     };
   } __attribute__ ((packed)) _decl ;
@@ -18,6 +20,8 @@ struct CharacteristicDecl : public AttributeBase {
 
 template<typename T>
 struct Characteristic : public CharacteristicDecl {
+  enum {ATTRIBUTES = 2}; // declaration and value
+
   Attribute<T> value;
   Characteristic(const UUID &uuid) : CharacteristicDecl(GATT::CHARACTERISTIC), value(uuid) {
     _decl.handle = value.handle;
@@ -28,18 +32,74 @@ struct Characteristic : public CharacteristicDecl {
   Characteristic &operator=(const T &rhs) {value = rhs; return *this;}
 };
 
-struct GATT_Service : public Attribute<uint16_t> {
-  CharacteristicDecl changed;
+/*
+ * Helpers for laying out a GATT database as a const table of records,
+ * which the compiler places in flash. Declarations and constant values
+ * live there too, and only values that change are in RAM. For example,
+ *
+ *   uint16_t appearance = 0;
+ *
+ *   const AttributeBase gap_attributes[] = {
+ *     GATT::primary_service<GATT::GENERIC_ACCESS_PROFILE, 4>(),
+ *     GATT::characteristic<GATT::READ, GATT::DEVICE_NAME>(),
+ *     GATT::characteristic_value(GATT::DEVICE_NAME, "Test Dev 1"),
+ *     GATT::characteristic<GATT::READ, GATT::APPEARANCE>(),
+ *     GATT::characteristic_value(GATT::APPEARANCE, appearance)
+ *   };
+ *
+ *   AttributeDatabase gap(gap_attributes);
+ *
+ * A service is told how many attributes follow it in its group, which
+ * AttributeBase::add() checks against the table.
+ */
+namespace GATT {
+  template<uint16_t uuid>
+  struct ServiceDeclaration {
+    static const uint8_t value[2];
+  };
 
-  GATT_Service();
-  virtual uint16_t group_end();
-};
+  template<uint16_t uuid>
+  const uint8_t ServiceDeclaration<uuid>::value[2] = {uuid & 0xff, uuid >> 8};
 
+  // the value handle is filled in by ATT_Channel when this is read
+  template<uint8_t properties, uint16_t uuid>
+  struct CharacteristicDeclaration {
+    static const uint8_t value[5];
+  };
 
-struct GAP_Service : public Attribute<uint16_t> {
-  Characteristic<const char *> device_name;
-  Characteristic<uint16_t> appearance;
+  template<uint8_t properties, uint16_t uuid>
+  const uint8_t CharacteristicDeclaration<properties, uuid>::value[5] = {properties, 0, 0, uuid & 0xff, uuid >> 8};
 
-  GAP_Service(const char *name, uint16_t a = 0);
-  virtual uint16_t group_end();
-};
+  template<uint16_t uuid, uint16_t attributes>
+  constexpr AttributeBase primary_service() {
+    return AttributeBase(PRIMARY_SERVICE, ServiceDeclaration<uuid>::value, 2, attributes);
+  }
+
+  template<uint8_t properties, uint16_t uuid>
+  constexpr AttributeBase characteristic() {
+    return AttributeBase(CHARACTERISTIC, CharacteristicDeclaration<properties, uuid>::value, 5, 0);
+  }
+
+  // a string constant, without its terminator
+  template<unsigned int n>
+  constexpr AttributeBase characteristic_value(uint16_t uuid, const char (&value)[n]) {
+    return AttributeBase(uuid, value, n - 1, 0);
+  }
+
+  // a variable, which may be in RAM, or a const object
+  template<typename T>
+  constexpr AttributeBase characteristic_value(uint16_t uuid, T &value) {
+    return AttributeBase(uuid, &value, sizeof(T), 0, std::is_const<T>::value);
+  }
+
+  /*
+   * The GAP and GATT services every device has (gatt.cc). The application
+   * adds them, so it decides where they go among its own attributes:
+   *
+   *   AttributeDatabase database(GATT::standard_services);
+   */
+  enum {STANDARD_ATTRIBUTES = 8};
+  extern const AttributeBase standard_services[STANDARD_ATTRIBUTES];
+  extern uint16_t appearance;
+  extern uint16_t service_changed[2]; // affected handle range
+}
@@ -1,13 +1,27 @@
+#include <algorithm>
+
 #include "assert.h"
 #include "h4.h"
 #include "hal.h"
+#include "critical.h"
 #include "hci.h"
+#include "trace.h"
+#include "snoop.h"
 
 H4Tranceiver::H4Tranceiver(UART *u) :
   uart(u),
   controller(0),
   rx(0),
-  rx_state(0)
+  dma(false),
+  rx_dma_busy(false),
+  tx_dma_busy(false),
+  rx_skip_remaining(0),
+  rx_state(0),
+  command_packets("command"),
+  acl_packets("acl"),
+  dropped_events(0),
+  dropped_acl(0),
+  next_acl_entry(0)
 {
   reset();
 }
@@ -16,98 +30,177 @@ void H4Tranceiver::reset() {
   command_packets.reset(); // all command packets are on the free list
   acl_packets.reset();     // same for acl packets
   packets_to_send.join(&packets_to_send); // clear the send queue
-  packets_received.join(&packets_received); // clear the receive queue
+  packets_received.clear();
+
+  rx_dma_busy = tx_dma_busy = false;
+  if (dma) uart->set_dma_enable(true); // abandon transfers in progress
+  for (uint8_t i=0; i < ACL_HANDLES; ++i) {
+    acl_completed[i].handle = NO_HANDLE;
+    acl_completed[i].count = 0;
+  }
 
   rx_new_packet(); // start looking for a new packet
 }
 
-void H4Tranceiver::wait_for_packets() {
-  while (packets_received.empty()) asm volatile ("wfi");
+void H4Tranceiver::set_dma_enable(bool value) {
+  dma = value;
+  rx_dma_busy = tx_dma_busy = false;
+  uart->set_dma_enable(value);
+}
+
+// waits forever if msec is zero
+bool H4Tranceiver::wait_for_packets(uint32_t msec) {
+  if (msec == 0) {
+    while (packets_received.empty()) CPU::wait_for_interrupt();
+    return true;
+  }
+
+  // nothing else wakes us up during boot, so watch the clock
+  uint32_t start = CPU::cycles();
+  uint32_t limit = msec*(CPU::get_clock_rate()/1000);
+
+  while (packets_received.empty()) {
+    if (CPU::cycles() - start >= limit) return false;
+    CPU::spin();
+  }
+
+  return true;
 }
 
 void H4Tranceiver::drain_uart() {
   assert(rx == 0 || rx->get_remaining() > 0);
 
-  while (rx && (rx->get_remaining() > 0) && uart->can_read()) {
-    uint8_t byte;
-    uart->read(&byte, 1);
-    rx->put(byte);
+  // read straight into the packet, as much as the FIFO holds for this state
+  while (rx && !rx_dma_busy && (rx->get_remaining() > 0)) {
+    size_t n = uart->read(rx->ptr(), rx->get_remaining());
+    if (n == 0) break;
+
+    rx->skip(n);
     if (rx->get_remaining() == 0) rx_state(this);
   }
 }
 
+// the main loop's side of packets_to_send, which the UART ISR takes from
+void H4Tranceiver::enqueue(Packet *p) {
+  CriticalSection masked;
+  p->join(&packets_to_send);
+}
+
 void H4Tranceiver::fill_uart() {
-  __asm("cpsid i");
+  if (dma) {
+    // each fragment of a packet goes in one transfer, and the next one
+    // is started from the completion interrupt
+    CriticalSection masked;
+
+    if (!tx_dma_busy && !packets_to_send.empty()) {
+      Packet *tx = packets_to_send.rbegin(); // first in, first out
+      tx_dma_busy = true;
+      uart->start_tx_dma(tx->fragment(), tx->get_fragment_remaining());
+    }
+    return;
+  }
 
-  while (!packets_to_send.empty() && uart->can_write()) {
-    Packet *tx = packets_to_send.rbegin(); // first in, first out
+  /*
+   * Interrupts are held off for one FIFO-sized chunk at a time, since
+   * this runs both from the UART ISR and from the main loop. Between
+   * chunks, pending RX interrupts get a chance to run.
+   */
+  for (bool full = false; !full;) {
+    CriticalSection masked;
 
-    while ((tx->get_remaining() > 0) && uart->can_write()) {
-      uint8_t byte = tx->get();
-      uart->write(&byte, 1);
-    }
+    if (packets_to_send.empty()) break;
 
+    Packet *tx = packets_to_send.rbegin(); // first in, first out
+    size_t length = tx->get_fragment_remaining();
+    size_t n = uart->write(tx->fragment(), length);
+    tx->skip(n);
+
+    full = n < length;
     if (tx->get_remaining() == 0) {
-      if (controller) controller->sent(tx);
-      tx->deallocate();
+      tx_done(tx);
+    } else if (full) {
+      // let the TX interrupt send the rest
+      uart->set_interrupt_sources(UART::RX | UART::TX | UART::ERROR);
     }
   }
+}
 
-  if (!packets_to_send.empty()) {
-    uart->set_interrupt_sources(UART::RX | UART::TX | UART::ERROR);
-  }
+void H4Tranceiver::tx_dma_complete() {
+  Packet *tx = packets_to_send.rbegin();
+
+  tx->skip(tx->get_fragment_remaining());
+  tx_dma_busy = false;
 
-  __asm("cpsie i");
+  if (tx->get_remaining() == 0) tx_done(tx);
+
+  fill_uart(); // start the next fragment or packet, if any
+}
+
+// the last byte of tx is in the UART
+void H4Tranceiver::tx_done(Packet *tx) {
+  trace(Trace::TX_DONE, tx->get(0), tx->get_limit());
+  snoop(tx, false);
+  if (controller) controller->sent(tx);
+  tx->deallocate();
+}
+
+void H4Tranceiver::rx_dma_complete() {
+  rx->skip(rx->get_remaining());
+  rx_dma_busy = false;
+  rx_state(this);
+
+  drain_uart(); // the next packet's header may already be in the FIFO
 }
 
 void H4Tranceiver::uart_interrupt() {
-  uint32_t cause = uart->clear_interrupt_cause(UART::RX | UART::TX | UART::ERROR);
+  uint32_t cause = uart->clear_interrupt_cause(UART::RX | UART::TX | UART::ERROR | UART::RX_DMA | UART::TX_DMA);
 
+  trace(Trace::ISR_ENTER);
   assert(!(cause & UART::ERROR));
 
+  if (cause & UART::TX_DMA) tx_dma_complete();
   if (cause & UART::TX) fill_uart();
+  if (cause & UART::RX_DMA) rx_dma_complete();
   if (cause & UART::RX) drain_uart();
 
-  // we always care about received data and errors
-  cause = UART::RX | UART::ERROR;
+  // we always care about errors
+  cause = UART::ERROR;
 
-  // but only enable the tx interrupt if there's data to send
-  if (!packets_to_send.empty()) cause |= UART::TX;
+  // and about received data, unless the uDMA is collecting a packet body
+  if (!rx_dma_busy) cause |= UART::RX;
+
+  // but only enable the tx interrupt if there's data to send by hand
+  if (!dma && !packets_to_send.empty()) cause |= UART::TX;
   uart->set_interrupt_sources(cause);
+  trace(Trace::ISR_EXIT);
 }
 
 void H4Tranceiver::rx_new_packet() {
-  indicator.reset();
-  indicator.set_limit(1);
-  rx = &indicator;
+  header.reset();
+  header.set_limit(Packet::HCI_HEADER_SIZE);
+  rx = &header;
   rx_state = &rx_packet_indicator;
 }
 
 void H4Tranceiver::rx_packet_indicator() {
-  uint8_t ind = indicator.peek(-1);
+  uint8_t ind = header.peek(-1);
+
+  trace(Trace::RX_START, ind);
 
   switch (ind) {
   case HCI::EVENT_PACKET :
-    rx = command_packets.allocate();
-    assert(rx != 0);
-
-    rx->set_limit(1+1+1); // indicator, event code, param length
-    rx->put(ind);
+    header.set_limit(Packet::EVENT_HEADER_SIZE); // indicator, event code, param length
     rx_state = &rx_event_header;
     break;
 
   case HCI::ACL_PACKET :
-    rx = acl_packets.allocate();
-    assert(rx != 0);
-
-    rx->set_limit(1+4);
-    rx->put(ind);
+    header.set_limit(Packet::ACL_HEADER_SIZE); // indicator, handle, length
     rx_state = &rx_acl_header;
     break;
 
   case HCI::GO_TO_SLEEP_IND :
     //debug("baseband wants to sleep!\n");
-    rx->reset();
+    rx_new_packet();
     break;
 
   case HCI::COMMAND_PACKET :
@@ -117,12 +210,53 @@ void H4Tranceiver::rx_packet_indicator() {
   }
 }
 
-void H4Tranceiver::rx_event_header() {
-  uint8_t param_length = rx->peek(-1);
+// moves the header into a packet from the size class that fits length bytes
+bool H4Tranceiver::rx_start_packet(PacketAllocator &packets, uint16_t length) {
+  rx = packets.allocate(length);
+  if (rx == 0) return false;
 
-  if (param_length > 0) {
-    rx->set_limit(1+1+1 + param_length);
+  header.flip();
+  rx->set_limit(length);
+  rx->write(header.ptr(), header.get_remaining());
+  return true;
+}
+
+/*
+ * When there's no packet to put it in, the rest of a packet is read
+ * through the header buffer and thrown away, so the stream stays in
+ * step. Flow control (see BBand) should keep this from happening to
+ * ACL data.
+ */
+void H4Tranceiver::rx_skip(uint16_t length) {
+  rx_skip_remaining = length;
+  rx_skip_chunk();
+}
+
+void H4Tranceiver::rx_skip_chunk() {
+  if (rx_skip_remaining == 0) {
+    rx_new_packet();
+    return;
+  }
+
+  uint16_t n = std::min(rx_skip_remaining, header.get_capacity());
+
+  header.reset(n);
+  rx_skip_remaining -= n;
+  rx = &header;
+  rx_state = &rx_skip_chunk;
+}
+
+void H4Tranceiver::rx_event_header() {
+  uint8_t param_length = header.peek(-1);
+
+  if (!rx_start_packet(command_packets, Packet::EVENT_HEADER_SIZE + param_length)) {
+    // even with the packets commands leave free, so the host is falling behind
+    dropped_events += 1;
+    debug("dropped event 0x%02x: no packet for %u bytes\n", header.peek(-2), param_length);
+    rx_skip(param_length);
+  } else if (param_length > 0) {
     rx_state = &rx_queue_received_packet;
+    if (dma) rx_start_body();
   } else {
     // there are no params, so just chain to the next state
     rx_queue_received_packet();
@@ -130,9 +264,68 @@ void H4Tranceiver::rx_event_header() {
 }
 
 void H4Tranceiver::rx_acl_header() {
-  uint16_t length = (rx->peek(-1) << 8) + (rx->peek(-2));
-  rx->set_limit(1+4+length);
-  rx_state = &rx_queue_received_packet;
+  uint16_t handle = ((header.peek(-3) << 8) + header.peek(-4)) & 0x0fff;
+  uint16_t length = (header.peek(-1) << 8) + (header.peek(-2));
+
+  if (!rx_start_packet(acl_packets, Packet::ACL_HEADER_SIZE + length)) {
+    // the controller's buffer is free again all the same
+    volatile uint16_t *counter = acl_counter(handle);
+
+    dropped_acl += 1;
+    if (counter) *counter += 1;
+    rx_skip(length);
+    return;
+  }
+
+  // the controller gets its buffer back once this packet is freed
+  rx->counter = acl_counter(handle);
+
+  if (length > 0) {
+    rx_state = &rx_queue_received_packet;
+    if (dma) rx_start_body();
+  } else {
+    // an empty payload would never be read, so queue it now
+    rx_queue_received_packet();
+  }
+}
+
+// where handle's freed packets are counted (from the ISR), or 0 if there's no room
+volatile uint16_t *H4Tranceiver::acl_counter(uint16_t handle) {
+  for (uint8_t i=0; i < ACL_HANDLES; ++i) {
+    if (acl_completed[i].handle == handle) return &acl_completed[i].count;
+  }
+
+  for (uint8_t i=0; i < ACL_HANDLES; ++i) {
+    ACLCompletions &e = acl_completed[(next_acl_entry + i) % ACL_HANDLES];
+
+    if (e.handle == NO_HANDLE) {
+      next_acl_entry = (next_acl_entry + i + 1) % ACL_HANDLES;
+      e.handle = handle;
+      e.count = 0;
+      return &e.count;
+    }
+  }
+
+  debug("no room to count ACL packets of 0x%04x\n", handle);
+  return 0;
+}
+
+// the controller takes back a connection's buffers when it goes
+void H4Tranceiver::forget_acl_handle(uint16_t handle) {
+  CriticalSection masked;
+
+  for (uint8_t i=0; i < ACL_HANDLES; ++i) {
+    if (acl_completed[i].handle == handle) {
+      acl_completed[i].handle = NO_HANDLE;
+      acl_completed[i].count = 0;
+    }
+  }
+}
+
+void H4Tranceiver::rx_start_body() {
+  // the header is in, so the rest goes straight into the packet
+  rx_dma_busy = true;
+  uart->start_rx_dma(rx->ptr(), rx->get_remaining());
 }
 
 void H4Tranceiver::rx_queue_received_packet() {
@@ -144,7 +337,10 @@ void H4Tranceiver::rx_queue_received_packet() {
   }
 
   rx->flip();
-  rx->join(&packets_received);
+  trace(Trace::RX_QUEUED, rx->get(0), rx->get_limit());
+  snoop(rx, true);
+  bool queued = packets_received.push(rx);
+  assert(queued);
   if (controller) controller->received(rx);
   rx_new_packet();
 }
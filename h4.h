@@ -2,12 +2,14 @@
 
 #include "packet.h"
 #include "pool.h"
+#include "spsc.h"
 
 class UART;
 class HostController;
 
 class H4Controller {
  public:
+  virtual void send(Packet *p) = 0;
   virtual void sent(Packet *p) = 0;
   virtual void received(Packet *p) = 0;
 };
@@ -19,7 +21,10 @@ class H4Tranceiver {
 
  private:
   Packet *rx;
-  SizedPacket<1> indicator;
+  SizedPacket<Packet::ACL_HEADER_SIZE> header; // until the length is known
+  bool dma;                     // packet bodies and TX packets go by uDMA
+  bool rx_dma_busy, tx_dma_busy;
+  uint16_t rx_skip_remaining;   // bytes of a dropped packet not yet read
 
   void (*rx_state)(H4Tranceiver *);
 
@@ -27,23 +32,60 @@ class H4Tranceiver {
   void rx_packet_indicator();
   void rx_event_header();
   void rx_acl_header();
+  bool rx_start_packet(PacketAllocator &packets, uint16_t length);
+  void rx_skip(uint16_t length);
+  void rx_skip_chunk();
   void rx_queue_received_packet();
+  void rx_start_body();
 
   void drain_uart();
+  void rx_dma_complete();
+  void tx_dma_complete();
+  void tx_done(Packet *tx);
+  volatile uint16_t *acl_counter(uint16_t handle);
 
  public:
-  PacketPool<259, 4> command_packets;
-  PacketPool<1000, 4> acl_packets;
+  /*
+   * Most commands, events and ATT PDUs are short, so they come from the
+   * small size class, and the few long ones (service pack commands, long
+   * ATT values) from the large one. This holds three times as many
+   * packets as four of the large size would, in about the same RAM.
+   */
+  TieredPacketPool<64, 6, 259, 2> command_packets;
+  enum {EVENT_RESERVE = 1}; // command packets of each size that commands leave for events
+  TieredPacketPool<64, 12, 1000, 3> acl_packets;
   Ring<Packet> packets_to_send;
-  Ring<Packet> packets_received;
+
+  // from the ISR to the main loop, which can hold every packet there is
+  SPSCQueue<Packet *, 32> packets_received;
+
+  // packets dropped because none of their size was free
+  uint32_t dropped_events, dropped_acl;
+
+  /*
+   * Received ACL packets freed (or dropped) since the host last told the
+   * controller, by connection. The ISR claims an entry the first time it
+   * sees a handle, and the host gives it up when the connection goes.
+   * Free entries are claimed in turn, so a packet of a connection that's
+   * gone is unlikely to be freed into another connection's count.
+   */
+  enum {ACL_HANDLES = 4, NO_HANDLE = 0xffff};
+  struct ACLCompletions {
+    uint16_t handle; // or NO_HANDLE
+    volatile uint16_t count;
+  } acl_completed[ACL_HANDLES];
+  uint8_t next_acl_entry; // the next free one to claim
 
   H4Tranceiver(UART *u);
 
   H4Controller *get_controller() const { return controller; }
   void set_controller(H4Controller *c) { controller = c; }
+  void set_dma_enable(bool value);
 
-  void wait_for_packets();
+  bool wait_for_packets(uint32_t msec = 0); // false if none came in time
   void reset();
+  void enqueue(Packet *p); // to be sent by fill_uart()
+  void forget_acl_handle(uint16_t handle);
   void fill_uart();
   void uart_interrupt();
 };
@@ -10,6 +10,7 @@
 #include "driverlib/interrupt.h"
 #include "driverlib/gpio.h"
 #include "driverlib/uart.h"
+#include "driverlib/udma.h"
 
 #include "hal.h"
 #include "register_defs.h"
@@ -26,10 +27,39 @@ void CPU::delay(uint32_t msec) {
   SysCtlDelay((get_clock_rate()*msec)/(3*1000));
 }
 
+// the DWT cycle counter, which runs once trace is enabled
+enum {
+  DEMCR = 0xe000edfc, // debug exception and monitor control
+  DWT_CTRL = 0xe0001000,
+  DWT_CYCCNT = 0xe0001004,
+
+  DEMCR_TRCENA = 1 << 24,
+  DWT_CTRL_CYCCNTENA = 1 << 0
+};
+
+#define CORE_REGISTER(address) (*(volatile uint32_t *) (address))
+
+void CPU::start_cycle_counter() {
+  CORE_REGISTER(DEMCR) |= DEMCR_TRCENA;
+  CORE_REGISTER(DWT_CYCCNT) = 0;
+  CORE_REGISTER(DWT_CTRL) |= DWT_CTRL_CYCCNTENA;
+}
+
+uint32_t CPU::cycles() {
+  return CORE_REGISTER(DWT_CYCCNT);
+}
+
 bool CPU::set_master_interrupt_enable(bool value) {
   return (value ? CPUcpsie() : CPUcpsid()) != 0;
 }
 
+void CPU::wait_for_interrupt() {
+  asm volatile ("wfi");
+}
+
+void CPU::spin() {
+}
+
 Peripheral::Peripheral() {
 }
 
@@ -165,8 +195,8 @@ IOPort::IOPort(char name) {
   }
 }
 
-IOPin::IOPin(char name, uint8_t pin, pin_type type) :
-  IOPort(name), mask(0x01 << pin), type(type)
+IOPin::IOPin(char name, uint8_t pin, pin_type type, bool keep) :
+  IOPort(name), mask(0x01 << pin), type(type), keep_level(keep)
 {
 }
 
@@ -175,6 +205,12 @@ void IOPin::configure() {
   switch (type) {
   case OUTPUT :
   case LED :
+    /*
+     * The pin is still an input after reset, so this reads whatever is
+     * holding it. The data register takes the level before the pin is
+     * driven, so it never glitches.
+     */
+    if (keep_level) set_value(get_value());
     GPIOPinTypeGPIOOutput((uint32_t) base, mask);
     break;
 
@@ -195,6 +231,11 @@ void IOPin::set_value(bool value) {
   GPIOPinWrite((uint32_t) base, mask, value ? mask : 0);
 }
 
+// for an output, the level it's driving
+bool IOPin::get_value() {
+  return GPIOPinRead((uint32_t) base, mask) != 0;
+}
+
 static uint32_t uart_base(uint32_t n) {
   switch (n) {
   case 0  : return UART0_BASE;
@@ -219,8 +260,27 @@ static uint32_t uart_interrupt(uint32_t n) {
   }
 }
 
+static uint32_t uart_rx_channel(uint32_t n) {
+  switch (n) {
+  case 0  : return UDMA_CHANNEL_UART0RX;
+  case 1  : return UDMA_CHANNEL_UART1RX;
+  default : return 0;
+  }
+}
+
+static uint32_t uart_tx_channel(uint32_t n) {
+  switch (n) {
+  case 0  : return UDMA_CHANNEL_UART0TX;
+  case 1  : return UDMA_CHANNEL_UART1TX;
+  default : return 0;
+  }
+}
+
 UART::UART(uint32_t n) :
-  Peripheral((void *) uart_base(n), uart_id(n), uart_interrupt(n))
+  Peripheral((void *) uart_base(n), uart_id(n), uart_interrupt(n)),
+  rx_channel(uart_rx_channel(n)),
+  tx_channel(uart_tx_channel(n)),
+  dma_busy(0)
 {
 }
   
@@ -264,26 +324,81 @@ void UART::flush_tx_buffer() {
   while (UARTBusy((uint32_t) base));
 }
 
+enum stellaris_uart_flags {
+  rx_fifo_empty = 0x00000010,
+  tx_fifo_full  = 0x00000020
+};
+
 size_t UART::read(uint8_t *dst, size_t max) {
-  size_t max0 = max;
+  uart_register_map *reg = (uart_register_map *) base;
+  size_t n = 0;
 
-  while (can_read() && max > 0) {
-    *dst++ = UARTCharGet((uint32_t) base);
-    max--;
-  }
+  // one flag test per byte, without going through driverlib
+  while (n < max && !(reg->FR & rx_fifo_empty)) dst[n++] = (uint8_t) reg->DR;
 
-  return max0 - max;
+  return n;
 }
 
 size_t UART::write(const uint8_t *src, size_t max) {
-  size_t max0 = max;
+  uart_register_map *reg = (uart_register_map *) base;
+  size_t n = 0;
+
+  while (n < max && !(reg->FR & tx_fifo_full)) reg->DR = src[n++];
+
+  return n;
+}
 
-  while (can_write() && max > 0) {
-    UARTCharPut((uint32_t) base, *src++);
-    max--;
+// the uDMA controller needs its channel control table on a 1K boundary
+static uint8_t dma_control_table[1024] __attribute__ ((aligned(1024)));
+
+static void enable_udma() {
+  static bool enabled = false;
+
+  if (!enabled) {
+    SysCtlPeripheralEnable(SYSCTL_PERIPH_UDMA);
+    uDMAEnable();
+    uDMAControlBaseSet(dma_control_table);
+    enabled = true;
   }
+}
+
+void UART::set_dma_enable(bool value) {
+  dma_busy = 0;
+
+  if (value) {
+    enable_udma();
+    uDMAChannelDisable(rx_channel);
+    uDMAChannelDisable(tx_channel);
 
-  return max0 - max;
+    const uint32_t attributes = UDMA_ATTR_ALTSELECT | UDMA_ATTR_USEBURST | UDMA_ATTR_HIGH_PRIORITY | UDMA_ATTR_REQMASK;
+    uDMAChannelAttributeDisable(rx_channel, attributes);
+    uDMAChannelAttributeDisable(tx_channel, attributes);
+
+    uDMAChannelControlSet(rx_channel | UDMA_PRI_SELECT, UDMA_SIZE_8 | UDMA_SRC_INC_NONE | UDMA_DST_INC_8 | UDMA_ARB_4);
+    uDMAChannelControlSet(tx_channel | UDMA_PRI_SELECT, UDMA_SIZE_8 | UDMA_SRC_INC_8 | UDMA_DST_INC_NONE | UDMA_ARB_4);
+
+    UARTDMAEnable((uint32_t) base, UART_DMA_RX | UART_DMA_TX);
+  } else {
+    UARTDMADisable((uint32_t) base, UART_DMA_RX | UART_DMA_TX);
+  }
+}
+
+void UART::start_rx_dma(uint8_t *dst, size_t length) {
+  assert(length > 0 && length <= 1024);
+
+  uDMAChannelTransferSet(rx_channel | UDMA_PRI_SELECT, UDMA_MODE_BASIC,
+                         (void *) &((uart_register_map *) base)->DR, dst, length);
+  dma_busy |= RX_DMA;
+  uDMAChannelEnable(rx_channel);
+}
+
+void UART::start_tx_dma(const uint8_t *src, size_t length) {
+  assert(length > 0 && length <= 1024);
+
+  uDMAChannelTransferSet(tx_channel | UDMA_PRI_SELECT, UDMA_MODE_BASIC,
+                         (void *) src, (void *) &((uart_register_map *) base)->DR, length);
+  dma_busy |= TX_DMA;
+  uDMAChannelEnable(tx_channel);
 }
 
 enum stellaris_uart_mask {
@@ -324,6 +439,11 @@ uint32_t UART::clear_interrupt_cause(uint32_t mask) {
   if (cause.TXIM) value |= TX;
   if (cause.w & error_mask) value |= ERROR;
 
+  // a channel disables itself when its transfer is complete
+  if ((dma_busy & RX_DMA) && !uDMAChannelIsEnabled(rx_channel)) value |= RX_DMA;
+  if ((dma_busy & TX_DMA) && !uDMAChannelIsEnabled(tx_channel)) value |= TX_DMA;
+  dma_busy &= ~(value & mask);
+
   if (mask & RX) cause.RXIM = cause.RTIM = 1;
   if (mask & TX) cause.TXIM = 1;
   if (mask & ERROR) cause.w |= error_mask;
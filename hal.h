@@ -11,7 +11,11 @@ class CPU {
   static void set_clock_rate_50MHz();
   static uint32_t get_clock_rate();
   static void delay(uint32_t msec);
+  static void start_cycle_counter();
+  static uint32_t cycles(); // since start_cycle_counter(), wrapping
   static bool set_master_interrupt_enable(bool value);
+  static void wait_for_interrupt();
+  static void spin(); // once around a busy-wait loop
 };
 
 class Peripheral {
@@ -46,21 +50,29 @@ class IOPin : public IOPort {
     ANALOG
   } type;
 
-  IOPin(char name, uint8_t pin, pin_type type);
+  // an output that keeps the level it's found at, across an MCU reset
+  const bool keep_level;
+
+  IOPin(char name, uint8_t pin, pin_type type, bool keep = false);
   virtual void configure();
   void set_value(bool value);
   bool get_value();
 };
 
 class UART : public Peripheral {
+  uint32_t rx_channel, tx_channel; // uDMA
+  uint32_t dma_busy;               // RX_DMA | TX_DMA
+
  public:
   UART(uint32_t n);
   UART(void *base, uint32_t id);
 
   enum interrupt_mask {
-    RX    = 0x01,
-    TX    = 0x02,
-    ERROR = 0x04
+    RX     = 0x01,
+    TX     = 0x02,
+    ERROR  = 0x04,
+    RX_DMA = 0x08, // a uDMA transfer has finished, regardless of the
+    TX_DMA = 0x10  // interrupt sources that are enabled
   };
 
   virtual void configure() = 0;
@@ -79,6 +91,12 @@ class UART : public Peripheral {
   virtual bool can_write();
   virtual size_t read(uint8_t *dst, size_t max);
   virtual size_t write(const uint8_t *src, size_t max);
+
+  // basic mode uDMA transfers between memory and the FIFOs, at most 1024
+  // bytes each. set_dma_enable() also abandons any transfers in progress.
+  void set_dma_enable(bool value);
+  void start_rx_dma(uint8_t *dst, size_t length);
+  void start_tx_dma(const uint8_t *src, size_t length);
 };
 
 class UART_0 : public UART {
@@ -0,0 +1,499 @@
+#ifndef __arm__
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+
+#include "hal.h"
+#include "hal_host.h"
+
+using namespace std;
+
+enum {
+  INT_UART0 = 21,
+  INT_UART1 = 22
+};
+
+static recursive_mutex cpu;             // owned by whoever is "executing"
+static condition_variable_any wakeup;
+static thread *interrupt_thread = 0;
+static bool running = false;
+static bool idle = false;               // the application thread is in wfi
+static bool primask = false;            // true when interrupts are masked
+static uint64_t masked_at = 0;          // nsec
+static uint32_t masked_histogram[NVIC::HISTOGRAM_BUCKETS];
+
+static NVIC::handler handlers[NVIC::NUM_INTERRUPTS];
+static bool enabled[NVIC::NUM_INTERRUPTS];
+static bool pended[NVIC::NUM_INTERRUPTS];
+static PeripheralModel *models = 0;
+
+static uint8_t gpio_data[9];
+
+PeripheralModel::PeripheralModel(uint32_t interrupt) :
+  interrupt(interrupt),
+  next(0)
+{
+}
+
+UARTModel::UARTModel(uint32_t interrupt) :
+  PeripheralModel(interrupt),
+  rx_fifo(rx_storage, sizeof(rx_storage)),
+  tx_fifo(tx_storage, sizeof(tx_storage)),
+  interrupt_mask(0),
+  baud(0),
+  enabled(false),
+  line_rate(false),
+  peer(0),
+  rx_bytes(0),
+  tx_bytes(0),
+  rx_credit(0),
+  tx_credit(0),
+  last_step(0)
+{
+}
+
+void UARTModel::inject(const uint8_t *bytes, size_t length) {
+  wire.insert(wire.end(), bytes, bytes + length);
+}
+
+uint32_t UARTModel::raw_status() const {
+  uint32_t status = 0;
+
+  if (rx_count() > 0) status |= UART::RX;
+  if (tx_count() <= FIFO_DEPTH/2) status |= UART::TX;
+  if (rx_dma.done) status |= UART::RX_DMA;
+  if (tx_dma.done) status |= UART::TX_DMA;
+
+  return status;
+}
+
+bool UARTModel::asserted() const {
+  // uDMA completion can't be masked
+  return (raw_status() & (interrupt_mask | UART::RX_DMA | UART::TX_DMA)) != 0;
+}
+
+bool UARTModel::step() {
+  if (!enabled) return false;
+
+  uint64_t now = NVIC::nanoseconds();
+
+  if (line_rate && baud > 0) {
+    // 10 bits per byte (start, 8 data, stop), never more than the FIFO
+    // and any uDMA transfer could take
+    double bytes = (now - last_step)*(baud/10.0)/1e9;
+
+    rx_credit = min(rx_credit + bytes, (double) (FIFO_DEPTH + rx_dma.remaining));
+    tx_credit = min(tx_credit + bytes, (double) (FIFO_DEPTH + tx_dma.remaining));
+  } else {
+    rx_credit = FIFO_DEPTH + rx_dma.remaining;
+    tx_credit = FIFO_DEPTH + tx_dma.remaining;
+  }
+  last_step = now;
+
+  size_t rx_budget = (size_t) rx_credit, tx_budget = (size_t) tx_credit;
+  uint64_t moved = rx_bytes + tx_bytes;
+
+  // the TX FIFO drains to the peer, which may respond immediately
+  uint8_t buffer[FIFO_DEPTH];
+  for (;;) {
+    service_tx_dma();
+
+    size_t n = tx_fifo.read(buffer, min(tx_budget, sizeof(buffer)));
+    if (n == 0) break;
+
+    tx_budget -= n;
+    tx_credit -= n;
+    tx_bytes += n;
+    if (peer) peer->uart_received(buffer, n);
+  }
+
+  if (peer) peer->poll();
+
+  // hardware flow control holds the remaining bytes on the wire
+  while (!wire.empty() && rx_count() < FIFO_DEPTH && rx_budget > 0) {
+    uint8_t byte = wire.front();
+    rx_fifo.write(&byte, 1);
+    wire.pop_front();
+    rx_budget -= 1;
+    rx_credit -= 1;
+    rx_bytes += 1;
+    service_rx_dma();
+  }
+
+  service_rx_dma();
+  return rx_bytes + tx_bytes != moved;
+}
+
+void UARTModel::service_tx_dma() {
+  if (tx_dma.remaining > 0 && tx_count() < FIFO_DEPTH) {
+    size_t n = tx_fifo.write(tx_dma.address, min(tx_dma.remaining, FIFO_DEPTH - tx_count()));
+    tx_dma.address += n;
+    tx_dma.remaining -= n;
+    tx_dma.done = tx_dma.remaining == 0;
+  }
+}
+
+void UARTModel::service_rx_dma() {
+  if (rx_dma.remaining > 0 && rx_count() > 0) {
+    size_t n = rx_fifo.read(rx_dma.address, min(rx_dma.remaining, rx_count()));
+    rx_dma.address += n;
+    rx_dma.remaining -= n;
+    rx_dma.done = rx_dma.remaining == 0;
+  }
+}
+
+void NVIC::attach(uint32_t interrupt, handler h) {
+  assert(interrupt < NUM_INTERRUPTS);
+  handlers[interrupt] = h;
+}
+
+void NVIC::add_model(PeripheralModel *m) {
+  m->next = models;
+  models = m;
+}
+
+void NVIC::set_enable(uint32_t interrupt, bool value) {
+  assert(interrupt < NUM_INTERRUPTS);
+  enabled[interrupt] = value;
+}
+
+void NVIC::pend(uint32_t interrupt) {
+  assert(interrupt < NUM_INTERRUPTS);
+  pended[interrupt] = true;
+}
+
+bool NVIC::set_primask(bool value) {
+  bool old = primask;
+
+  if (value && !old) {
+    masked_at = nanoseconds();
+  } else if (!value && old) {
+    uint64_t elapsed = nanoseconds() - masked_at;
+    uint32_t bucket = 0;
+
+    while (elapsed > 1 && bucket < HISTOGRAM_BUCKETS - 1) {
+      elapsed >>= 1;
+      bucket += 1;
+    }
+
+    masked_histogram[bucket] += 1;
+  }
+
+  primask = value;
+  return old;
+}
+
+uint32_t NVIC::masked_count(uint32_t bucket) {
+  return bucket < HISTOGRAM_BUCKETS ? masked_histogram[bucket] : 0;
+}
+
+void NVIC::reset_masked_histogram() {
+  for (uint32_t i=0; i < HISTOGRAM_BUCKETS; ++i) masked_histogram[i] = 0;
+}
+
+UARTModel *NVIC::uart(uint32_t n) {
+  // constructed on first use, since UART objects are themselves static
+  static UARTModel uart_models[2] = {UARTModel(INT_UART0), UARTModel(INT_UART1)};
+
+  return n < 2 ? &uart_models[n] : 0;
+}
+
+uint64_t NVIC::nanoseconds() {
+  return chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static bool deliver_interrupts() {
+  bool delivered = false;
+
+  if (primask) return false;
+
+  for (uint32_t i=0; i < NVIC::NUM_INTERRUPTS; ++i) {
+    if (!enabled[i] || handlers[i] == 0) continue;
+
+    bool asserted = pended[i];
+    for (PeripheralModel *m = models; m && !asserted; m = m->next) {
+      if (m->interrupt == i) asserted = m->asserted();
+    }
+
+    if (asserted) {
+      pended[i] = false;
+      handlers[i]();
+      delivered = true;
+    }
+  }
+
+  return delivered;
+}
+
+static void interrupt_thread_main() {
+  unique_lock<recursive_mutex> lock(cpu);
+
+  while (running) {
+    if (!idle) {
+      wakeup.wait(lock);
+      continue;
+    }
+
+    bool busy = false;
+    for (PeripheralModel *m = models; m; m = m->next) busy |= m->step();
+
+    if (deliver_interrupts()) {
+      idle = false;
+      wakeup.notify_all();
+    } else if (!busy) {
+      wakeup.wait_for(lock, chrono::microseconds(50));
+    }
+  }
+}
+
+void NVIC::start() {
+  assert(interrupt_thread == 0);
+
+  for (uint32_t i=0; uart(i) != 0; ++i) add_model(uart(i));
+
+  cpu.lock();
+  running = true;
+  idle = false;
+  interrupt_thread = new thread(interrupt_thread_main);
+}
+
+void NVIC::stop() {
+  assert(interrupt_thread != 0);
+
+  running = false;
+  wakeup.notify_all();
+  cpu.unlock();
+  interrupt_thread->join();
+  delete interrupt_thread;
+  interrupt_thread = 0;
+}
+
+bool NVIC::wait(uint32_t usec) {
+  idle = true;
+  wakeup.notify_all();
+
+  if (usec == 0) {
+    wakeup.wait(cpu, [] {return !idle;});
+    return true;
+  }
+
+  bool interrupted = wakeup.wait_for(cpu, chrono::microseconds(usec), [] {return !idle;});
+  idle = false;
+  return interrupted;
+}
+
+void CPU::set_clock_rate_50MHz() {
+}
+
+uint32_t CPU::get_clock_rate() {
+  return 50000000;
+}
+
+void CPU::delay(uint32_t msec) {
+  chrono::steady_clock::time_point until = chrono::steady_clock::now() + chrono::milliseconds(msec);
+
+  // interrupts keep being serviced while the target spins
+  for (;;) {
+    chrono::steady_clock::time_point now = chrono::steady_clock::now();
+    if (now >= until) break;
+    NVIC::wait(chrono::duration_cast<chrono::microseconds>(until - now).count() + 1);
+  }
+}
+
+void CPU::start_cycle_counter() {
+}
+
+// host time at the device's clock rate
+uint32_t CPU::cycles() {
+  return (uint32_t) (NVIC::nanoseconds()*(get_clock_rate()/1000000)/1000);
+}
+
+bool CPU::set_master_interrupt_enable(bool value) {
+  return NVIC::set_primask(!value);
+}
+
+void CPU::wait_for_interrupt() {
+  NVIC::wait();
+}
+
+// interrupts only run while the target waits, so let them
+void CPU::spin() {
+  NVIC::wait(10);
+}
+
+Peripheral::Peripheral() {
+}
+
+Peripheral::Peripheral(void *base, uint32_t id, uint32_t interrupt) :
+  base(base), id(id), interrupt(interrupt)
+{
+}
+
+void Peripheral::configure() {
+}
+
+void Peripheral::initialize() {
+}
+
+void Peripheral::set_interrupt_enable(bool value) {
+  NVIC::set_enable(interrupt, value);
+}
+
+void Peripheral::pend_interrupt() {
+  NVIC::pend(interrupt);
+}
+
+IOPort::IOPort(char name) {
+  if (name >= 'A' && name <= 'J' && name != 'I') {
+    base = (void *) &gpio_data[name < 'I' ? name - 'A' : name - 'B'];
+  } else {
+    base = (void *) 0;
+  }
+
+  id = 0;
+  interrupt = 0;
+}
+
+IOPin::IOPin(char name, uint8_t pin, pin_type type, bool keep) :
+  IOPort(name), mask(0x01 << pin), type(type), keep_level(keep)
+{
+}
+
+void IOPin::configure() {
+}
+
+void IOPin::set_value(bool value) {
+  uint8_t *data = (uint8_t *) base;
+  if (value) *data |= mask;
+  else       *data &= ~mask;
+}
+
+bool IOPin::get_value() {
+  return (*(uint8_t *) base & mask) != 0;
+}
+
+UART::UART(uint32_t n) :
+  Peripheral((void *) NVIC::uart(n), 0, NVIC::uart(n)->interrupt),
+  rx_channel(0),
+  tx_channel(0),
+  dma_busy(0)
+{
+}
+
+void UART::initialize() {
+}
+
+void UART::set_enable(bool value) {
+  ((UARTModel *) base)->enabled = value;
+}
+
+void UART::set_fifo_enable(bool value) {
+}
+
+void UART::set_baud(uint32_t bps) {
+  UARTModel *model = (UARTModel *) base;
+
+  model->baud = bps;
+  if (model->peer) model->peer->uart_baud_changed(bps);
+}
+
+bool UART::can_read() {
+  return ((UARTModel *) base)->rx_count() > 0;
+}
+
+bool UART::can_write() {
+  return ((UARTModel *) base)->tx_count() < UARTModel::FIFO_DEPTH;
+}
+
+void UART::flush_rx_fifo() {
+  uint8_t dummy;
+  while (can_read()) read(&dummy, 1);
+}
+
+void UART::flush_tx_buffer() {
+}
+
+size_t UART::read(uint8_t *dst, size_t max) {
+  UARTModel *model = (UARTModel *) base;
+
+  if (max > model->rx_count()) max = model->rx_count();
+  return model->rx_fifo.read(dst, max);
+}
+
+size_t UART::write(const uint8_t *src, size_t max) {
+  UARTModel *model = (UARTModel *) base;
+  size_t space = UARTModel::FIFO_DEPTH - model->tx_count();
+
+  if (max > space) max = space;
+  return model->tx_fifo.write(src, max);
+}
+
+void UART::set_interrupt_sources(uint32_t hal_mask) {
+  ((UARTModel *) base)->interrupt_mask = hal_mask;
+}
+
+uint32_t UART::disable_all_interrupt_sources() {
+  UARTModel *model = (UARTModel *) base;
+  uint32_t value = model->interrupt_mask;
+  model->interrupt_mask = 0;
+  return value;
+}
+
+void UART::reenable_interrupt_sources(uint32_t mask) {
+  ((UARTModel *) base)->interrupt_mask = mask;
+}
+
+uint32_t UART::clear_interrupt_cause(uint32_t mask) {
+  UARTModel *model = (UARTModel *) base;
+
+  // causes are level sensitive in the model, except for uDMA completion
+  uint32_t cause = model->raw_status() & (model->interrupt_mask | RX_DMA | TX_DMA);
+
+  if (mask & RX_DMA) model->rx_dma.done = false;
+  if (mask & TX_DMA) model->tx_dma.done = false;
+  return cause;
+}
+
+void UART::set_dma_enable(bool value) {
+  UARTModel *model = (UARTModel *) base;
+
+  model->rx_dma = DMAChannel();
+  model->tx_dma = DMAChannel();
+}
+
+void UART::start_rx_dma(uint8_t *dst, size_t length) {
+  assert(length > 0 && length <= 1024);
+  ((UARTModel *) base)->rx_dma.start(dst, length);
+}
+
+void UART::start_tx_dma(const uint8_t *src, size_t length) {
+  assert(length > 0 && length <= 1024);
+  ((UARTModel *) base)->tx_dma.start((uint8_t *) src, length);
+}
+
+UART_0::UART_0() : UART(0)
+{
+}
+
+void UART_0::configure() {
+}
+
+UART_1::UART_1() : UART(1)
+{
+}
+
+void UART_1::configure() {
+}
+
+Systick::Systick(uint32_t msec) :
+  msec(msec)
+{
+}
+
+void Systick::configure() {
+}
+
+void Systick::initialize() {
+}
+#endif
@@ -0,0 +1,111 @@
+#ifndef __arm__
+#pragma once
+
+#include <stdint.h>
+#include <cstddef>
+#include <deque>
+
+#include "buffer.h"
+
+/*
+ * Host-side models of the LM3S9D96 peripherals used by the Bluetooth
+ * stack. The simulated CPU is a mutex: the application thread owns it
+ * except while it waits for an interrupt. During that time, a separate
+ * interrupt thread advances the peripheral models and calls any pending
+ * handlers, just as the NVIC would on the target. Handlers therefore
+ * never run concurrently with application code.
+ */
+
+class UARTPeer {
+ public:
+  // bytes written by the MCU have left the TX FIFO
+  virtual void uart_received(const uint8_t *bytes, size_t length) = 0;
+  virtual void uart_baud_changed(uint32_t bps) {}
+
+  // called from the interrupt thread each time the models are advanced
+  virtual void poll() {}
+};
+
+class PeripheralModel {
+ public:
+  uint32_t interrupt;
+  PeripheralModel *next;
+
+  PeripheralModel(uint32_t interrupt);
+  virtual bool step() {return false;} // true if the model made progress
+  virtual bool asserted() const {return false;}
+};
+
+// one basic mode uDMA channel between memory and a FIFO
+struct DMAChannel {
+  uint8_t *address;
+  size_t remaining;
+  bool done;
+
+  DMAChannel() : address(0), remaining(0), done(false) {}
+  void start(uint8_t *a, size_t n) {address = a; remaining = n; done = false;}
+};
+
+class UARTModel : public PeripheralModel {
+ public:
+  enum {FIFO_DEPTH = 16};
+
+ private:
+  uint8_t rx_storage[FIFO_DEPTH + 1];
+  uint8_t tx_storage[FIFO_DEPTH + 1];
+
+ public:
+  RingBuffer<uint8_t> rx_fifo, tx_fifo;
+  std::deque<uint8_t> wire; // sent by the peer, but not yet in the RX FIFO
+  uint32_t interrupt_mask;  // UART::RX | UART::TX | UART::ERROR
+  uint32_t baud;
+  bool enabled;
+  bool line_rate;           // limit both directions to baud/10 bytes per second
+  UARTPeer *peer;
+  uint64_t rx_bytes, tx_bytes;
+  DMAChannel rx_dma, tx_dma;
+
+ private:
+  double rx_credit, tx_credit; // bytes the line could have carried
+  uint64_t last_step;          // nsec
+
+  void service_tx_dma();
+  void service_rx_dma();
+
+ public:
+  UARTModel(uint32_t interrupt);
+
+  void attach(UARTPeer *p) {peer = p;}
+  void inject(const uint8_t *bytes, size_t length);
+  size_t rx_count() const {return rx_fifo.read_capacity();}
+  size_t tx_count() const {return tx_fifo.read_capacity();}
+  uint32_t raw_status() const;
+
+  virtual bool step();
+  virtual bool asserted() const;
+};
+
+class NVIC {
+ public:
+  enum {NUM_INTERRUPTS = 64, HISTOGRAM_BUCKETS = 32};
+  typedef void (*handler)();
+
+  static void attach(uint32_t interrupt, handler h);
+  static void add_model(PeripheralModel *m);
+  static void set_enable(uint32_t interrupt, bool value);
+  static void pend(uint32_t interrupt);
+  static bool set_primask(bool value);
+
+  // how long interrupts stay masked: bucket n counts intervals of
+  // [2^n, 2^(n+1)) nsec
+  static uint32_t masked_count(uint32_t bucket);
+  static void reset_masked_histogram();
+
+  static void start(); // claim the CPU and start the interrupt thread
+  static void stop();
+  static bool wait(uint32_t usec = 0); // false if the timeout expired first
+
+  static UARTModel *uart(uint32_t n);
+  static uint64_t nanoseconds(); // monotonic host time
+};
+#endif
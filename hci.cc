@@ -3,8 +3,9 @@
 #include "l2cap.h"
 #include "cc_stubs.h"
 #include "h4.h"
+#include "critical.h"
 #include "assert.h"
-#include "bts.h"
+#include "trace.h"
 
 using namespace HCI;
 
@@ -16,9 +17,10 @@ const char hex_digits[16] = {
 char BD_ADDR::pp_buf[24];
 
 uint16_t AttributeBase::next_handle = 0;
-AttributeBase *AttributeBase::all_handles[AttributeBase::MAX_ATTRIBUTES];
+uint16_t *AttributeBase::cursor = 0;
+bool AttributeBase::indexed = false;
 
-int AttributeBase::compare(void *other, uint16_t len) {
+int AttributeBase::compare(void *other, uint16_t len) const {
   size_t shorter = length < len ? length : len;
   int c = memcmp(_data, other, shorter);
   if (c != 0) return c;
@@ -29,13 +31,21 @@ int AttributeBase::compare(void *other, uint16_t len) {
 extern H4Tranceiver h4;
 
 BBand::BBand(UART &u, IOPin &s) :
-  HostController((PoolBase<Packet> *) &h4.command_packets,
-                 (PoolBase<Packet> *) &h4.acl_packets,
+  HostController(&h4.command_packets,
+                 &h4.acl_packets,
                  (PoolBase<HCI::Connection> *) &hci_connection_pool),
   uart(u),
   shutdown(s),
+  hci_connection_pool("conn"),
   script(0),
-  event_handler(&default_event_handler)
+  acl_flow_control(false),
+  acl_offered(0),
+  event_handler(&default_event_handler),
+  cold_boot_usec(0),
+  patch_usec(0),
+  warm_boot_usec(0),
+  booted(false),
+  boot_attempts(0)
 {
 }
 
@@ -47,6 +57,11 @@ extern "C" const uint8_t cold_boot[];
 extern uint32_t cold_boot_size;
 extern "C" const uint8_t warm_boot[];
 extern uint32_t warm_boot_size;
+extern "C" const uint8_t warm_restart[];
+extern uint32_t warm_restart_size;
+extern uint32_t warm_restart_baud;
+extern "C" const uint8_t warm_restart_probe[];
+extern uint32_t warm_restart_probe_size;
 
 BBand::HCIScript::HCIScript(BBand &b, uint8_t *bytes, uint16_t length) :
   CannedScript(::h4, bytes, length),
@@ -62,6 +77,26 @@ bool BBand::HCIScript::command_complete(uint16_t opcode, Packet *p) {
   return CannedScript::command_complete(opcode, p);
 }
 
+BBand::RestartScript::RestartScript(BBand &b) :
+  HCIScript(b, (uint8_t *) warm_restart, warm_restart_size),
+  patched(false)
+{
+}
+
+bool BBand::RestartScript::command_complete(uint16_t opcode, Packet *p) {
+  if (opcode == OPCODE_READ_MEMORY && expects(opcode)) {
+    uint16_t position = p->get_position();
+    uint8_t status;
+
+    *p >> status;
+    patched = status == HCI::SUCCESS && p->get_remaining() >= warm_restart_probe_size &&
+      memcmp((uint8_t *) *p, warm_restart_probe, warm_restart_probe_size) == 0;
+    p->rewind(position); // the script reads the status too
+  }
+
+  return HCIScript::command_complete(opcode, p);
+}
+
 BBand::WarmBootScript::WarmBootScript(BBand &b) :
   HCIScript(b, (uint8_t *) warm_boot, warm_boot_size)
 {
@@ -74,11 +109,39 @@ void BBand::WarmBootScript::send(Packet *p) {
     p->rewind();
   }
 
+  if (last_opcode == OPCODE_HOST_BUFFER_SIZE) {
+    /*
+     * L2CAP frames aren't reassembled, so the controller is offered the
+     * longest packet we have, and only as many as there are of that
+     * size. Shorter ones land in smaller packets, which leaves the rest
+     * for responses we originate.
+     */
+    const PacketAllocator::SizeClass &largest = h4.acl_packets.size_class(h4.acl_packets.size_classes() - 1);
+
+    bb.acl_offered = largest.pool->capacity;
+    p->seek(Packet::COMMAND_HEADER_SIZE);
+    *p << (uint16_t) (largest.packet_size - Packet::ACL_HEADER_SIZE) << (uint8_t) 0;
+    *p << bb.acl_offered << (uint16_t) 0;
+    p->rewind();
+  }
+
   HCIScript::send(p);
 }
 
+// advertising parameters are sent with the address read here
+bool BBand::WarmBootScript::must_complete(uint16_t opcode) const {
+  return opcode == OPCODE_READ_BD_ADDR || HCIScript::must_complete(opcode);
+}
+
 bool BBand::WarmBootScript::command_complete(uint16_t opcode, Packet *p) {
-  if (opcode == last_opcode && opcode == OPCODE_READ_BD_ADDR) {
+  if (expects(opcode) &&
+      (opcode == OPCODE_READ_BUFFER_SIZE_COMMAND || opcode == OPCODE_LE_READ_BUFFER_SIZE)) {
+    uint16_t position = p->get_position();
+    bb.read_buffer_size(opcode, p);
+    p->rewind(position); // the script reads the status too
+  }
+
+  if (opcode == OPCODE_READ_BD_ADDR && retire(opcode)) {
     uint8_t status;
     *p >> status;
 
@@ -86,83 +149,351 @@ bool BBand::WarmBootScript::command_complete(uint16_t opcode, Packet *p) {
       p->read((uint8_t *) &bb.bd_addr, sizeof(bb.bd_addr));
     }
     p->deallocate();
-    last_opcode = 0;
     next();
     return true;
   } else {
+    if (opcode == OPCODE_SET_CONTROLLER_TO_HOST_FLOW_CONTROL && expects(opcode)) {
+      bb.acl_flow_control = true;
+    }
+
     return HCIScript::command_complete(opcode, p);
   }
 }
 
 void BBand::initialize() {
+  // unless the controller was shut down (here, or during an MCU reset), it may still have its patch
+  bool patched = shutdown.get_value() && restart();
+
+  /*
+   * A script that stalls leaves its commands queued and counted against
+   * the controller, so rather than carry on, start over from SHUTDOWN.
+   */
+  booted = false;
+  boot_attempts = 0;
+
+  while (!booted && boot_attempts < BOOT_ATTEMPTS) {
+    boot_attempts += 1;
+
+    if (patched || boot_from_shutdown()) {
+      WarmBootScript warm_boot_script(*this);
+      booted = execute_commands(warm_boot_script, warm_boot_usec);
+    }
+
+    if (!booted) {
+      debug("boot attempt %u stalled\n", boot_attempts);
+      patched = false;
+    }
+  }
+
+  debug("boot: cold %u usec, patch %u usec, warm %u usec\n", cold_boot_usec, patch_usec, warm_boot_usec);
+
+  //cold_boot(0, 0);
+}
+
+// power cycles the controller and uploads the service pack. False if it stalled.
+bool BBand::boot_from_shutdown() {
   uart.set_enable(false);
   uart.set_interrupt_enable(false);
   shutdown.set_value(0); // assert SHUTDOWN
   uart.set_baud(115200);
   uart.set_enable(true);
 
-  h4.reset();
+  reset();
 
   uart.set_interrupt_sources(UART::RX | UART::ERROR);
   command_complete_handler = &normal_operation;// &cold_boot;
 
+  CPU::delay(5); // long enough for the controller to see it
   shutdown.set_value(1); // clear SHUTDOWN
   uart.set_interrupt_enable(true);
 
   CPU::delay(150); // wait 150 msec
 
-  HCIScript cold_boot_script(*this, (uint8_t *) cold_boot, cold_boot_size);
-  execute_commands(cold_boot_script);
+  patch_usec = 0;
+
+  // each script holds an LZSS window, so only one is on the stack at a time
+  {
+    HCIScript cold_boot_script(*this, (uint8_t *) cold_boot, cold_boot_size);
+    if (!execute_commands(cold_boot_script, cold_boot_usec)) return false;
+  }
 
+  // the service pack switches to its top baud rate with its first command
   HCIScript oem_boot_script(*this, (uint8_t *) bluetooth_init_cc2564, bluetooth_init_cc2564_size);
-  execute_commands(oem_boot_script);
+  return execute_commands(oem_boot_script, patch_usec);
+}
 
-  WarmBootScript warm_boot_script(*this);
-  execute_commands(warm_boot_script);
+// forgets every packet, queued command and connection
+void BBand::reset() {
+  // throw away whatever the controller was sending, until the line goes quiet
+  do {
+    uart.flush_rx_fifo();
+    CPU::delay(1);
+  } while (uart.can_read());
+
+  h4.reset(); // which empties every queue as it frees the packets
+  hci_connection_pool.reset();
+  command_packet_budget = 1;
+  commands_outstanding = 0;
+  acl_credits = 0;
+  acl_flow_control = false;
+}
 
-  //cold_boot(0, 0);
+/*
+ * Resets the controller at the rate the service pack left it, and reads
+ * back the last memory the pack wrote. If that's all there, the patch
+ * survived and only the warm boot is needed.
+ */
+bool BBand::restart() {
+  uart.set_enable(false);
+  uart.set_interrupt_enable(false);
+  uart.set_baud(warm_restart_baud);
+  uart.set_enable(true);
+
+  reset();
+
+  uart.set_interrupt_sources(UART::RX | UART::ERROR);
+  command_complete_handler = &normal_operation;
+  uart.set_interrupt_enable(true);
+
+  RestartScript probe(*this);
+  bool answered = execute_commands(probe, cold_boot_usec, RESTART_TIMEOUT);
+  patch_usec = 0;
+
+  return answered && probe.patched;
 }
 
-void BBand::execute_commands(HCIScript &s) {
+/*
+ * Sets usec to the time taken, giving up if a wait exceeds timeout msec.
+ * Returns false if it gave up.
+ */
+bool BBand::execute_commands(HCIScript &s, uint32_t &usec, uint32_t timeout) {
+  uint32_t start = CPU::cycles();
+
   assert(script == 0);
   script = &s;
 
   script->next();
 
   do {
-    h4.wait_for_packets();
+    if (!h4.wait_for_packets(timeout)) { // the controller isn't answering
+      debug("script stalled after %u msec\n", timeout);
+      break;
+    }
     process_incoming_packets();
   } while (!s.is_complete());
 
   script = 0;
+  usec = (CPU::cycles() - start)/(CPU::get_clock_rate()/1000000);
+  return s.is_complete();
 }
 
 void HostController::send(Packet *p) {
   extern H4Tranceiver h4;
   assert(p != 0);
   p->prepare_for_tx();
-  p->join(&h4.packets_to_send);
+  trace(Trace::TX_QUEUED, p->get(0), p->get_limit());
+
+  if (p->get(0) == ACL_PACKET) {
+    Connection *c = find_connection((p->get(1) + (p->get(2) << 8)) & 0x0fff);
+
+    if (c == 0) {
+      debug("dropping ACL data for a connection that's gone\n");
+      p->deallocate();
+      return;
+    }
+
+    /*
+     * Nothing here fragments ACL data, so each packet must fit in one of
+     * the controller's buffers. ATT is the only sender, and its PDUs are
+     * at most att_mtu (23) bytes. With the 4 byte L2CAP header that's 27,
+     * the smallest buffer an LE controller may have, and what the CC2564
+     * reports.
+     */
+    assert(p->get_limit() - Packet::ACL_HEADER_SIZE <= acl_buffer_length);
+
+    p->join(&c->waiting);
+    send_acl();
+    return;
+  }
+
+  // the controller takes Host Number Of Completed Packets at any time
+  if (p->get(0) == COMMAND_PACKET &&
+      p->get(1) + (p->get(2) << 8) != OPCODE_HOST_NUMBER_OF_COMPLETED_PACKETS) {
+    p->join(&waiting_commands);
+    send_commands();
+    return;
+  }
+
+  h4.enqueue(p);
   h4.fill_uart();
 }
 
+// opcode is 0 if the event completes none of our commands
+void HostController::set_command_budget(uint8_t count, uint16_t opcode) {
+  if (opcode != 0 && commands_outstanding > 0) {
+    commands_outstanding -= 1;
+    if (count == 0) count = 1;
+  }
+
+  command_packet_budget = count;
+  send_commands();
+}
+
+// sends waiting commands, oldest first, while the controller has room
+void HostController::send_commands() {
+  extern H4Tranceiver h4;
+  bool sent = false;
+
+  while (command_packet_budget > 0 && !waiting_commands.empty()) {
+    Packet *p = waiting_commands.rbegin();
+    h4.enqueue(p);
+    command_packet_budget -= 1;
+    commands_outstanding += 1;
+    sent = true;
+  }
+
+  if (sent) h4.fill_uart();
+}
+
+void HostController::set_acl_buffers(uint16_t length, uint16_t count) {
+  acl_buffer_length = length;
+  acl_credits = count;
+}
+
+// sends waiting ACL packets, oldest first, while the controller has room
+void HostController::send_acl() {
+  extern H4Tranceiver h4;
+  bool sent = false;
+
+  while (acl_credits > 0) {
+    Connection *c = 0;
+
+    for (Ring<Connection>::Iterator i = remotes.rbegin(); i != remotes.end(); --i) {
+      if (!i->waiting.empty()) {
+        c = i;
+        break;
+      }
+    }
+
+    if (c == 0) break;
+
+    Packet *p = c->waiting.rbegin();
+    h4.enqueue(p);
+    c->outstanding += 1;
+    acl_credits -= 1;
+    c->join(&remotes); // to the back of the line
+    sent = true;
+  }
+
+  if (sent) h4.fill_uart();
+}
+
+Connection *HostController::find_connection(uint16_t handle) {
+  for (Ring<Connection>::Iterator i = remotes.begin(); i != remotes.end(); ++i) {
+    if (i->handle == handle) return i;
+  }
+
+  return 0;
+}
+
+void HostController::connected(uint16_t handle) {
+  Connection *c = connections->allocate();
+
+  if (c == 0) {
+    debug("no room for connection 0x%04x\n", handle);
+    return;
+  }
+
+  c->handle = handle;
+  c->join(&remotes);
+}
+
+// the controller frees the buffers of a connection that's gone
+void HostController::disconnected(uint16_t handle) {
+  Connection *c = find_connection(handle);
+  if (c == 0) return;
+
+  while (!c->waiting.empty()) c->waiting.begin()->deallocate();
+  acl_credits += c->outstanding;
+  connections->deallocate(c);
+}
+
+/*
+ * A disconnection has already given back the credits of its packets, so
+ * only those still outstanding on a known connection count. Anything
+ * else the controller reports is ignored.
+ */
+void HostController::completed(uint16_t handle, uint16_t count) {
+  Connection *c = find_connection(handle);
+  if (c == 0) return;
+
+  if (count > c->outstanding) {
+    debug("0x%04x completed %u packets, but only %u were sent\n", handle, count, c->outstanding);
+    count = c->outstanding;
+  }
+
+  c->outstanding -= count;
+  acl_credits += count;
+}
+
 void BBand::process_incoming_packets() {
   extern H4Tranceiver h4;
   Packet *p;
 
-  do {
-    uart.set_interrupt_enable(false);
+  // the ISR can keep queueing packets meanwhile
+  while (h4.packets_received.pop(p)) {
+    uint8_t indicator = p->get(0);
+    trace(Trace::DISPATCH, indicator, p->get_limit());
+    standard_packet_handler(p);
+    trace(Trace::HANDLED, indicator);
+  }
 
-    Ring<Packet>::Iterator i = h4.packets_received.rbegin();
-    if (i != h4.packets_received.end()) {
-      p = i;
-      p->join(p);
-    } else {
-      p = 0;
+  if (acl_flow_control) return_acl_buffers();
+}
+
+/*
+ * Tells the controller about received ACL packets we've since freed,
+ * once they're half of what it was offered. Until then, either the
+ * controller still has half of its offer left, or we're holding the
+ * packets that will make up the rest.
+ */
+void BBand::return_acl_buffers() {
+  extern H4Tranceiver h4;
+  enum {N = H4Tranceiver::ACL_HANDLES};
+  uint16_t freed = 0;
+
+  for (uint8_t i=0; i < N; ++i) {
+    if (h4.acl_completed[i].handle != H4Tranceiver::NO_HANDLE) freed += h4.acl_completed[i].count;
+  }
+
+  if (freed < (acl_offered + 1)/2) return;
+
+  Packet *p = command_packets->allocate(Packet::COMMAND_HEADER_SIZE + 1 + 2*N*sizeof(uint16_t),
+                                        H4Tranceiver::EVENT_RESERVE);
+  if (p == 0) return; // try again next time
+
+  uint16_t handles[N], counts[N];
+  uint8_t n = 0;
+
+  {
+    CriticalSection masked;
+
+    for (uint8_t i=0; i < N; ++i) {
+      H4Tranceiver::ACLCompletions &e = h4.acl_completed[i];
+      if (e.handle == H4Tranceiver::NO_HANDLE || e.count == 0) continue;
+
+      handles[n] = e.handle;
+      counts[n] = e.count;
+      e.count = 0;
+      n += 1;
     }
-    uart.set_interrupt_enable(true);
+  }
 
-    if (p) standard_packet_handler(p);
-  } while (p);
+  // all of the handles, then all of the counts
+  p->hci(OPCODE_HOST_NUMBER_OF_COMPLETED_PACKETS) << n;
+  for (uint8_t i=0; i < n; ++i) *p << handles[i];
+  for (uint8_t i=0; i < n; ++i) *p << counts[i];
+  send(p);
 }
 
 void BBand::default_event_handler(uint8_t event, Packet *p) {
@@ -175,6 +506,8 @@ void BBand::default_event_handler(uint8_t event, Packet *p) {
     handle &= 0x0fff;
 
     debug("disconnected 0x%04x (with status: 0x%02x) because 0x%02x\n", handle, status, reason);
+    disconnected(handle);
+    h4.forget_acl_handle(handle);
     debug("re-enabling LE advertising\n");
     p->hci(OPCODE_LE_SET_ADVERTISE_ENABLE) << (uint8_t) 0x01;
     send(p);
@@ -192,17 +525,17 @@ void BBand::default_event_handler(uint8_t event, Packet *p) {
     uint8_t number_of_handles;
 
     *p >> number_of_handles;
-    // uint16_t *connection_handle = (uint16_t *) (uint8_t *) *p;
-    p->skip(number_of_handles*sizeof(uint16_t));
-    // uint8_t *num_of_completed_packets = (uint8_t *) *p;
+
+    // all of the handles, then all of the counts
+    const uint8_t *handles = *p;
+    const uint8_t *counts = handles + number_of_handles*sizeof(uint16_t);
 
     for (uint8_t i=0; i < number_of_handles; ++i) {
-      /*
-      debug("connection 0x%04x completed %d packets\n",
-                 connection_handle[i],
-                 num_of_completed_packets[i]);
-      */
+      uint16_t handle = handles[2*i] + (handles[2*i + 1] << 8);
+      completed(handle & 0x0fff, counts[2*i] + (counts[2*i + 1] << 8));
     }
+
+    send_acl();
     break;
   }
   default :
@@ -221,7 +554,7 @@ void BBand::le_event_handler(uint8_t subevent, Packet *p) {
 
     *p >> status >> connection_handle >> role;
     *p >> peer_address_type;
-    p->write(peer_address.data, sizeof(peer_address.data));
+    p->read(peer_address.data, sizeof(peer_address.data));
     *p >> conn_interval >> conn_latency;
     *p >> supervision_timeout >> master_clock_accuracy;
 
@@ -262,6 +595,8 @@ void BBand::le_event_handler(uint8_t subevent, Packet *p) {
     debug("  handle = 0x%04x, addr_type = %s\n", connection_handle, type);
     debug("  role = %s, interval = %d, latency = %d, timeout = %d\n", role_name, conn_interval, conn_latency, supervision_timeout);
     debug("  clock_accuracy = %d\n", master_clock_accuracy);
+
+    if (status == SUCCESS) connected(connection_handle & 0x0fff);
     break;
   }
   case LE_EVENT_ADVERTISING_REPORT :
@@ -282,10 +617,20 @@ void BBand::standard_packet_handler(Packet *p) {
     uint8_t parameter_length __attribute__ ((unused)) = p->get();
 
     if (event == EVENT_COMMAND_COMPLETE) {
+      uint8_t budget;
       uint16_t opcode;
 
-      *p >> command_packet_budget >> opcode;
+      *p >> budget >> opcode;
       command_complete(opcode, p);
+      set_command_budget(budget, opcode);
+    } else if (event == EVENT_COMMAND_STATUS) {
+      uint8_t status, budget;
+      uint16_t opcode;
+
+      *p >> status >> budget >> opcode;
+      if (status != SUCCESS) debug("opcode 0x%04x failed with status 0x%02x\n", opcode, status);
+      if (!script || !script->command_status(opcode, p)) p->deallocate();
+      set_command_budget(budget, opcode);
     } else {
       event_handler(this, event, p);
     }
@@ -338,18 +683,10 @@ void BBand::command_complete(uint16_t opcode, Packet *p) {
     break;
   }
 
-  case OPCODE_READ_BUFFER_SIZE_COMMAND : {
-    uint16_t acl_data_length, num_acl_packets, num_synchronous_packets;
-    uint8_t synchronous_data_length;
-
-    *p >> acl_data_length >> synchronous_data_length;
-    *p >> num_acl_packets >> num_synchronous_packets;
-
-    debug("acl: %d @ %d, synchronous: %d @ %d\n",
-               num_acl_packets, acl_data_length,
-               num_synchronous_packets, synchronous_data_length);
+  case OPCODE_READ_BUFFER_SIZE_COMMAND :
+  case OPCODE_LE_READ_BUFFER_SIZE :
+    read_buffer_size(opcode, p);
     break;
-  }
 
   case OPCODE_READ_PAGE_TIMEOUT : {
     uint16_t timeout;
@@ -360,16 +697,6 @@ void BBand::command_complete(uint16_t opcode, Packet *p) {
     break;
   }
 
-  case OPCODE_LE_READ_BUFFER_SIZE : {
-    debug("buffer size read\n");
-    uint16_t le_data_packet_length;
-    uint8_t num_le_packets;
-
-    *p >> le_data_packet_length >> num_le_packets;
-    debug("le_data_packet_length = %d, num_packets = %d\n", le_data_packet_length, num_le_packets);
-    break;
-  }
-
   case OPCODE_LE_READ_SUPPORTED_STATES : {
     debug("supported states read\n");
 
@@ -469,6 +796,38 @@ void BBand::upload_patch(uint16_t opcode, Packet *p) {
 }
 #endif
 
+/*
+ * LE data goes through the LE buffers, unless the controller has none
+ * of its own, in which case it shares the ACL buffers. The script reads
+ * the ACL sizes first.
+ */
+void BBand::read_buffer_size(uint16_t opcode, Packet *p) {
+  uint8_t status;
+
+  *p >> status;
+  if (status != SUCCESS) return;
+
+  if (opcode == OPCODE_READ_BUFFER_SIZE_COMMAND) {
+    uint16_t acl_data_length, num_acl_packets, num_synchronous_packets;
+    uint8_t synchronous_data_length;
+
+    *p >> acl_data_length >> synchronous_data_length;
+    *p >> num_acl_packets >> num_synchronous_packets;
+
+    debug("acl: %d @ %d, synchronous: %d @ %d\n",
+               num_acl_packets, acl_data_length,
+               num_synchronous_packets, synchronous_data_length);
+    set_acl_buffers(acl_data_length, num_acl_packets);
+  } else {
+    uint16_t le_data_packet_length;
+    uint8_t num_le_packets;
+
+    *p >> le_data_packet_length >> num_le_packets;
+    debug("le_data_packet_length = %d, num_packets = %d\n", le_data_packet_length, num_le_packets);
+    if (le_data_packet_length != 0) set_acl_buffers(le_data_packet_length, num_le_packets);
+  }
+}
+
 void BBand::normal_operation(uint16_t opcode, Packet *p) {
   debug("OK 0x%04x\n", opcode);
   p->deallocate();
@@ -20,7 +20,12 @@ extern const char hex_digits[16];
 
 namespace HCI {
   class Connection : public Ring<Connection> {
+   public:
     uint16_t handle;
+    uint16_t outstanding; // ACL packets the controller hasn't completed
+    Ring<Packet> waiting; // ACL packets held until the controller has room
+
+    void reset() {handle = 0; outstanding = 0;}
   };
 };
 
@@ -28,20 +33,53 @@ using namespace HCI;
 
 class HostController : public H4Controller {
  protected:
-  PoolBase<Packet> *command_packets;
-  PoolBase<Packet> *acl_packets;
+  PacketAllocator *command_packets;
+  PacketAllocator *acl_packets;
   PoolBase<Connection> *connections;
 
   Ring<Connection> remotes;
+
+  /*
+   * Commands are flow controlled too. Command Complete and Command Status
+   * events say how many more the controller can take (one, after a
+   * reset), and the rest wait here in the order they were sent. The
+   * CC2564 says zero in nearly every completion of a service pack
+   * command and never follows up with another event, so completing a
+   * command we sent always frees its own slot.
+   */
+  Ring<Packet> waiting_commands;
   uint8_t command_packet_budget;
+  uint8_t commands_outstanding; // sent, but not yet completed
+
+  /*
+   * ACL data to the controller is flow controlled: it reports how many
+   * packets it can buffer, and each one we send uses a credit until a
+   * Number Of Completed Packets event gives it back. Packets wait on
+   * their connection until there's a credit, and connections take turns.
+   */
+  uint16_t acl_buffer_length; // longest ACL payload the controller takes, which send() checks
+  uint16_t acl_credits;       // ACL packets the controller can take now
+
+  void set_command_budget(uint8_t count, uint16_t opcode);
+  void send_commands();
+  void set_acl_buffers(uint16_t length, uint16_t count);
+  void send_acl();
+  Connection *find_connection(uint16_t handle);
+  void connected(uint16_t handle);
+  void disconnected(uint16_t handle);
+  void completed(uint16_t handle, uint16_t count);
 
  public:
   BD_ADDR bd_addr;
 
-  HostController(PoolBase<Packet> *cmd, PoolBase<Packet> *acl, PoolBase<Connection> *conn) :
+  HostController(PacketAllocator *cmd, PacketAllocator *acl, PoolBase<Connection> *conn) :
     command_packets(cmd),
     acl_packets(acl),
-    connections(conn)
+    connections(conn),
+    command_packet_budget(1),
+    commands_outstanding(0),
+    acl_buffer_length(0),
+    acl_credits(0)
   {}
 
   // H4Controller methods
@@ -51,6 +89,7 @@ class HostController : public H4Controller {
   virtual void initialize() {}
   virtual void periodic(uint32_t msec) {}
   virtual void send(Packet *p);
+  bool is_connected(uint16_t handle) {return find_connection(handle) != 0;}
   virtual void receive(Packet *p) {
     // p->join(&incoming_packets);
   }
@@ -69,8 +108,18 @@ class BBand : public HostController {
     virtual bool command_complete(uint16_t opcode, Packet *p);
   };
 
+  // finds out whether the controller still has the service pack
+  class RestartScript : public HCIScript {
+  public:
+    bool patched;
+
+    RestartScript(BBand &b);
+    virtual bool command_complete(uint16_t opcode, Packet *p);
+  };
+
   class WarmBootScript : public HCIScript {
   protected:
+    virtual bool must_complete(uint16_t opcode) const;
     virtual void send(Packet *p);
 
   public:
@@ -82,18 +131,34 @@ class BBand : public HostController {
   IOPin &shutdown;
   Pool<HCI::Connection, 3> hci_connection_pool;
   HCIScript *script;
+  bool acl_flow_control; // the controller waits for us to free ACL packets
+  uint16_t acl_offered;  // ACL packets it may send before we free any
 
   void (*event_handler)(BBand *, uint8_t event, Packet *);
   void (*command_complete_handler)(BBand *, uint16_t opcode, Packet *);
 
+  // a patched controller answers at once, even after a reset
+  enum {RESTART_TIMEOUT = 50}; // msec
+
+  // and one that doesn't answer the boot scripts in this long never will
+  enum {BOOT_TIMEOUT = 1000}; // msec
+
+  // power ups before initialize() gives up on the controller
+  enum {BOOT_ATTEMPTS = 3};
+
   // initialization states
-  void execute_commands(HCIScript &s);
+  void reset();
+  bool restart();
+  bool boot_from_shutdown();
+  bool execute_commands(HCIScript &s, uint32_t &usec, uint32_t timeout = BOOT_TIMEOUT);
 
   // void cold_boot(uint16_t opcode, Packet *p);
   // void upload_patch(uint16_t opcode, Packet *p);
   // void warm_boot(uint16_t opcode, Packet *p);
   void normal_operation(uint16_t opcode, Packet *p);
   void command_complete(uint16_t opcode, Packet *p);
+  void return_acl_buffers();
+  void read_buffer_size(uint16_t opcode, Packet *p);
   
   void standard_packet_handler(Packet *p);
   void default_event_handler(uint8_t event, Packet *p);
@@ -110,6 +175,14 @@ class BBand : public HostController {
   } patch_state;
 
  public:
+  // how long each phase of initialize() took. After a restart that
+  // found the patch still in place, cold_boot_usec is the time taken to
+  // find out and patch_usec is zero.
+  uint32_t cold_boot_usec, patch_usec, warm_boot_usec;
+
+  bool booted;           // false if initialize() gave up on the controller
+  uint8_t boot_attempts; // that initialize() made, counting the one that worked
+
   BBand(UART &u, IOPin &s);
   void initialize();
   void process_incoming_packets();
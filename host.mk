@@ -1,14 +1,43 @@
 BUILD = build
 OBJ = $(BUILD)/host
-BTS_SOURCES = bts.cc
+BTS_SOURCES = bts.cc lzss.cc
 BTS_OBJECTS = $(addsuffix .o,$(addprefix $(OBJ)/,$(basename $(BTS_SOURCES))))
-CFLAGS += -g
+# static constructors run in link order, so sim.cc (the application) must
+# come after the stack objects it registers with
+SIM_SOURCES = att.cc debug_service.cc gatt.cc h4.cc hal_host.cc hci.cc l2cap.cc log.cc lzss.cc pool.cc script.cc snoop.cc trace.cc uuid.cc virtual_controller.cc bluetooth_init_cc2564.cc sim.cc
+SIM_OBJECTS = $(addsuffix .o,$(addprefix $(OBJ)/,$(basename $(SIM_SOURCES))))
+CFLAGS += -g -O2 -I. -I$(BUILD) -std=gnu++0x -fms-extensions -Wno-pmf-conversions -pthread
+# sim keeps every trace record of a 20000 request run
+$(BUILD)/sim : CFLAGS += -DTRACE -DTRACE_CAPACITY=0x80000
+# and whole packets in the capture, which it drains as it goes
+$(BUILD)/sim : CFLAGS += -DSNOOP -DSNOOP_CAPACITY=0x100000 -DSNOOP_SNAP_LENGTH=1029
+# and the debug messages logged during boot, which sim -v prints
+$(BUILD)/sim : CFLAGS += -DDEBUG -DLOG_CAPACITY=1024
 
 BTS = $(BUILD)/bts
-
-vpath $(OBJ)
-
-default : $(BUILD)/bluetooth_init_cc2564.cc
+SIM = $(BUILD)/sim
+
+vpath %.cc . $(BUILD)
+
+default : $(BUILD)/bluetooth_init_cc2564.cc $(SIM)
+
+bench : $(SIM)
+	$(SIM)
+	$(SIM) -a 3
+	$(SIM) -g
+	$(SIM) -q 3 -n 2000
+	$(SIM) -q 0 -n 2000
+	$(SIM) -R -n 2000
+	$(SIM) -x 50 -n 2000
+	$(SIM) -s 990 -w 3 -n 5000
+	$(SIM) -s 990 -w 3 -n 5000 -d
+	$(SIM) -t 20000
+	$(SIM) -t 2000 -c 1000
+	$(SIM) -b 400
+	$(SIM) -Q 10000000
+
+report : $(BTS)
+	$(BTS) -r ./bluetooth_init_cc2564_2.1.bts
 
 clean :
 	rm -rf $(BUILD)
@@ -25,6 +54,8 @@ $(OBJ)/%.o : %.cc $(OBJ)/.sentinel
 $(BTS) : $(BTS_OBJECTS)
 	$(CXX) -o $(BTS) $(BTS_OBJECTS)
 
+$(SIM) : $(SIM_OBJECTS)
+	$(CXX) -pthread -o $(SIM) $(SIM_OBJECTS)
+
 $(BUILD)/bluetooth_init_cc2564.cc : $(BTS) bluetooth_init_cc2564_2.1.bts $(BUILD)/.sentinel
 	$(BTS) ./bluetooth_init_cc2564_2.1.bts bluetooth_init_cc2564 >$(BUILD)/bluetooth_init_cc2564.cc
-
@@ -0,0 +1,83 @@
+#ifdef DEBUG
+#include <stdio.h>
+#include <string.h>
+
+#include "log.h"
+
+static_assert((Log::CAPACITY & (Log::CAPACITY - 1)) == 0, "LOG_CAPACITY must be a power of 2");
+
+Log::Entry Log::ring[CAPACITY];
+volatile uint32_t Log::head = 0;
+volatile uint32_t Log::tail = 0;
+volatile uint32_t Log::gap = 0;
+volatile uint32_t Log::dropped = 0;
+uint32_t Log::dropped_reported = 0;
+
+Log::Entry *Log::claim() {
+  uint32_t h;
+
+  do {
+    h = head;
+    if (h - tail >= CAPACITY) {
+      __sync_fetch_and_add(&dropped, 1);
+      gap = h;
+      return 0;
+    }
+  } while (!__sync_bool_compare_and_swap(&head, h, h + 1));
+
+  return &ring[h & (CAPACITY - 1)];
+}
+
+void Log::commit(Entry *e, const char *format) {
+  __sync_synchronize(); // the arguments are in place before the format
+  e->format = format;
+}
+
+// copies what fits, leaving the rest of the message's string space for later arguments
+uintptr_t Log::word(Entry *e, uint16_t &used, const char *s) {
+  char *copy = e->strings + used;
+  uint16_t room = STRING_SPACE - used;
+
+  if (room == 0) return (uintptr_t) "";
+
+  strncpy(copy, s, room - 1);
+  copy[room - 1] = 0;
+  used += strlen(copy) + 1;
+  return (uintptr_t) copy;
+}
+
+bool Log::drain(void (*show)(const char *line)) {
+  char line[LINE_LENGTH];
+
+  // in place of what was dropped
+  if (dropped != dropped_reported && tail == gap) {
+    uint32_t n = dropped - dropped_reported;
+
+    dropped_reported += n;
+    if (show) {
+      snprintf(line, sizeof(line), "[%u debug messages dropped]\n", (unsigned) n);
+      show(line);
+    }
+    return true;
+  }
+
+  if (tail == head) return false;
+
+  Entry *e = &ring[tail & (CAPACITY - 1)];
+  const char *format = e->format;
+
+  if (format == 0) return false; // claimed, but still being filled in
+  __sync_synchronize();
+
+  if (show) {
+    // arguments past the format's are ignored
+    snprintf(line, sizeof(line), format, e->args[0], e->args[1], e->args[2], e->args[3], e->args[4], e->args[5]);
+    show(line);
+  }
+
+  e->format = 0;
+  __sync_synchronize(); // done with the slot before it can be claimed again
+  tail = tail + 1;
+  return true;
+}
+#endif
@@ -0,0 +1,76 @@
+#pragma once
+
+#include <stdint.h>
+
+#ifndef LOG_CAPACITY
+#define LOG_CAPACITY 64
+#endif
+
+/*
+ * What debug() records. Rather than format a message where it's logged,
+ * which takes far longer than the code being debugged (and rendering it
+ * to the LCD longer still), debug() keeps the format and its arguments in
+ * a ring, and the main loop formats them with drain() when it's idle.
+ * Arguments are kept as words, so formats may use any conversion but
+ * floating point and 64-bit ones. Strings are copied, up to
+ * STRING_SPACE bytes per message, since they're often in buffers that
+ * are about to be reused (e.g., UUID::pretty_print()).
+ *
+ * Messages can be logged from the main loop and from ISRs. A slot is
+ * claimed with a compare and swap and handed over by setting its format,
+ * so there's no lock. When the ring is full, messages are dropped and
+ * counted.
+ */
+class Log {
+ public:
+  enum {
+    CAPACITY = LOG_CAPACITY, // messages, a power of 2
+    MAX_ARGS = 6,
+    STRING_SPACE = 32,
+    LINE_LENGTH = 128        // formatted
+  };
+
+ private:
+  struct Entry {
+    const char *volatile format; // 0 until the rest is filled in
+    uintptr_t args[MAX_ARGS];
+    char strings[STRING_SPACE];
+  };
+
+  static Entry ring[CAPACITY];
+  static volatile uint32_t head; // slots claimed
+  static volatile uint32_t tail; // and drained
+  static volatile uint32_t gap;  // the slot that messages were last dropped before
+  static uint32_t dropped_reported;
+
+  static Entry *claim();
+  static void commit(Entry *e, const char *format);
+
+  template<typename T>
+  static uintptr_t word(Entry *, uint16_t &, T x) {return (uintptr_t) x;}
+  static uintptr_t word(Entry *e, uint16_t &used, const char *s);
+  static uintptr_t word(Entry *e, uint16_t &used, char *s) {return word(e, used, (const char *) s);}
+
+ public:
+  static volatile uint32_t dropped;
+
+  template<typename... Args>
+  static void record(const char *format, Args... args) {
+    static_assert(sizeof...(args) <= MAX_ARGS, "too many arguments for debug()");
+
+    Entry *e = claim();
+    if (e == 0) return;
+
+    uint16_t used = 0; // string bytes copied so far, if there are any strings
+    uintptr_t *a = e->args;
+    int unused[] = {0, (*a++ = word(e, used, args), 0)...};
+    (void) unused;
+    (void) used;
+
+    commit(e, format);
+  }
+
+  // formats the oldest message and passes it to show (or discards it, if
+  // show is 0). Returns false if there was none.
+  static bool drain(void (*show)(const char *line));
+};
@@ -0,0 +1,53 @@
+#include "lzss.h"
+
+void LZSS::rewind() {
+  in = start;
+  head = 0;
+  match_distance = 0;
+  match_length = 0;
+  flags = 0;
+  flag_count = 0;
+}
+
+uint16_t LZSS::read(uint8_t *dst, uint16_t length) {
+  uint16_t n = 0;
+
+  while (n < length) {
+    uint8_t b;
+
+    if (match_length == 0) {
+      if (in == end) break;
+
+      if (flag_count == 0) {
+        flags = *in++;
+        flag_count = 8;
+      }
+
+      bool match = flags & 1;
+      flags >>= 1;
+      flag_count -= 1;
+
+      if (match) {
+        uint16_t code = in[0] + (in[1] << 8);
+        in += 2;
+        match_distance = (code & (WINDOW - 1)) + 1;
+        match_length = (code >> DISTANCE_BITS) + MIN_MATCH;
+      } else {
+        b = *in++;
+        window[head] = b;
+        head = (head + 1) & (WINDOW - 1);
+        dst[n++] = b;
+        continue;
+      }
+    }
+
+    // byte at a time, since a match may overlap the bytes it produces
+    b = window[(head - match_distance) & (WINDOW - 1)];
+    match_length -= 1;
+    window[head] = b;
+    head = (head + 1) & (WINDOW - 1);
+    dst[n++] = b;
+  }
+
+  return n;
+}
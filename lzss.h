@@ -0,0 +1,35 @@
+#pragma once
+
+#include <stdint.h>
+
+/*
+ * LZSS, as used for the canned HCI scripts. Each flag byte describes the
+ * next eight items, low bit first. A 0 bit is a literal byte, and a 1 bit
+ * is a two byte (little-endian) match whose low DISTANCE_BITS are how far
+ * back the match starts, less one, and whose high bits are its length,
+ * less MIN_MATCH. The expander keeps the last WINDOW bytes it produced,
+ * so a script can be expanded one command at a time.
+ */
+class LZSS {
+ public:
+  enum {
+    DISTANCE_BITS = 10,
+    WINDOW = 1 << DISTANCE_BITS,
+    MIN_MATCH = 3,
+    MAX_MATCH = MIN_MATCH + (1 << (16 - DISTANCE_BITS)) - 1
+  };
+
+ private:
+  const uint8_t *start, *in, *end;
+  uint8_t window[WINDOW];
+  uint16_t head;                         // where the next byte goes in window
+  uint16_t match_distance, match_length; // of the match being copied
+  uint8_t flags, flag_count;             // items left in this group
+
+ public:
+  LZSS(const uint8_t *bytes, uint32_t length) : start(bytes), end(bytes + length) {rewind();}
+
+  void rewind();
+  bool at_end() const {return in == end && match_length == 0;}
+  uint16_t read(uint8_t *dst, uint16_t length); // returns the bytes expanded
+};
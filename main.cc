@@ -7,21 +7,31 @@
 #include "h4.h"
 #include "att.h"
 #include "gatt.h"
+#include "debug_service.h"
+#include "snoop.h"
 
 #ifdef DEBUG
 #include "screen.h"
 #endif
 
 IOPin led1('F', 3, IOPin::LED);
-IOPin pc4('C', 4, IOPin::OUTPUT);
+IOPin pc4('C', 4, IOPin::OUTPUT, true); // SHUTDOWN, so the controller can outlive an MCU reset
+#ifdef SNOOP
+UART_0 uart0; // where the HCI capture goes
+#else
 //UART0 uart0;
+#endif
 UART_1 uart1;
 BBand pan1323(uart1, pc4);
 Systick systick(100);
 H4Tranceiver h4(&uart1);
 ATT_Channel att_channel(pan1323);
-GAP_Service gap("Test Dev 1");
-GATT_Service gatt;
+
+AttributeDatabase database(GATT::standard_services);
+
+#ifdef DEBUG
+AttributeDatabase debug_attributes(DebugService::attributes);
+#endif
 
 class Temp {
   ADC adc0;
@@ -148,6 +158,8 @@ public:
 } knob;
 
 struct MyService : public Attribute<uint16_t> {
+  enum {ATTRIBUTES = 1 + 3*Characteristic<char>::ATTRIBUTES};
+
   Characteristic<char> char_1;
   Characteristic<char> char_2;
   Characteristic<char> char_3;
@@ -158,15 +170,22 @@ struct MyService : public Attribute<uint16_t> {
       char_2((uint16_t) 0xfff2),
       char_3("00001234-0000-1000-8000-00805F9B34FB")
   {
+    group_length = char_3.value.handle - handle;
   }
-
-  virtual uint16_t group_end() {return char_3.handle;}
 };
 
 MyService my;
+ATTRIBUTE_TABLE(GATT::STANDARD_ATTRIBUTES + DebugService::ATTRIBUTES + MyService::ATTRIBUTES);
+
+#ifdef DEBUG
+static void show(const char *line) {
+  Screen::the_screen.text(line);
+}
+#endif
 
 extern "C" int main() {
   CPU::set_clock_rate_50MHz();
+  CPU::start_cycle_counter();
   CPU::set_master_interrupt_enable(false);
 
 #ifdef DEBUG
@@ -175,7 +194,13 @@ extern "C" int main() {
 
   led1.configure();
   pc4.configure();
+#ifdef SNOOP
+  uart0.configure();
+  uart0.set_baud(115200);
+  uart0.set_enable(true);
+#else
   //uart0.configure();
+#endif
   uart1.configure();
   uart1.initialize();
   //internal_temperature.configure();
@@ -196,9 +221,11 @@ extern "C" int main() {
   
 #ifdef DEBUG
   AttributeBase::dump_attributes();
+  while (Log::drain(show)); // before the ring fills
 #endif
 
   pan1323.initialize();
+  if (!pan1323.booted) debug("the controller didn't boot in %u attempts\n", pan1323.boot_attempts);
   systick.initialize();
 
   do {
@@ -206,6 +233,24 @@ extern "C" int main() {
     //internal_temperature.farenheit();
     pan1323.process_incoming_packets();
     led1.set_value(1);
+
+#ifdef DEBUG
+    DebugService::refresh();
+
+    // one message at a time, so packets aren't kept waiting
+    if (Log::drain(show)) continue;
+#endif
+
+#ifdef SNOOP
+    // the capture goes out between packets, and keeps us awake until it's gone
+    uint16_t n;
+    const uint8_t *bytes = Snoop::pending(n);
+    if (n > 0) {
+      Snoop::consume(uart0.write(bytes, n));
+      continue;
+    }
+#endif
+
     asm volatile ("wfi");
   } while (true);
 }
@@ -32,7 +32,7 @@ class FlipBuffer {
   }
 
   void set_limit(uint16_t l) {limit = l;}
-  void reset(uint16_t lim=0) {position = 0; limit = (lim == 0) ? capacity : lim;}
+  void reset(uint16_t lim=0) {assert(lim <= capacity); position = 0; limit = (lim == 0) ? capacity : lim;}
   void flip() {limit = position; position = 0;}
   void unflip() {position = limit; limit = capacity;}
   void rewind(uint16_t p = 0) {position = p;}
@@ -45,22 +45,79 @@ class FlipBuffer {
   void put(const uint8_t x) {assert(position < limit); storage[position++] = x;}
 };
 
+/*
+ * A Packet's bytes normally all live in its own storage. For large
+ * values, the tail of the packet can instead be borrowed from memory
+ * that outlives it (e.g., an attribute's value), so the bytes go from
+ * there to the UART without being copied. Positions count both parts
+ * together; fragment() and get_fragment_remaining() give the contiguous
+ * run at the current position.
+ */
 class Packet : public Ring<Packet>, public FlipBuffer {
+  const uint8_t *borrowed;
+  uint16_t borrowed_at;
+
  public:
-  const char *title;
-  Ring<Packet> *free_packets;
+  PoolBase<Packet> *pool;     // where deallocate() returns this packet
+  volatile uint16_t *counter; // if set, deallocate() counts this packet there
 
  Packet() :
-  title(0),
-  free_packets(0)
+  borrowed(0),
+  borrowed_at(0),
+  pool(0),
+  counter(0)
  {}
 
   Packet(uint8_t *buf, uint16_t len) :
     FlipBuffer(buf, len),
-    title(0),
-    free_packets(0)
+    borrowed(0),
+    borrowed_at(0),
+    pool(0),
+    counter(0)
   {}
-  void deallocate() {assert(free_packets != 0); join(free_packets);}
+
+  void deallocate() {
+    assert(pool != 0);
+    borrowed = 0;
+    if (counter) {
+      // the ISR frees received packets too, once they're reused as responses
+      CriticalSection masked;
+      *counter += 1;
+      counter = 0;
+    }
+    pool->deallocate(this);
+  }
+  void reset(uint16_t lim=0) {FlipBuffer::reset(lim); borrowed = 0;}
+
+  // appends len bytes by reference; nothing more can be written after them
+  Packet &borrow(const uint8_t *p, uint16_t len) {
+    assert(borrowed == 0 && position + len <= limit);
+    borrowed = p;
+    borrowed_at = position;
+    position += len;
+    return *this;
+  }
+
+  bool is_scattered() const {return borrowed != 0;}
+
+  const uint8_t *fragment() const {
+    if (borrowed && position >= borrowed_at) return borrowed + (position - borrowed_at);
+    return storage + position;
+  }
+
+  uint16_t get_fragment_remaining() const {
+    if (borrowed && position < borrowed_at) return borrowed_at - position;
+    return limit - position;
+  }
+
+  // copies len bytes starting at from, wherever they're kept, leaving the position alone
+  void copy(uint16_t from, uint8_t *dst, uint16_t len) const {
+    uint16_t n = len;
+
+    if (borrowed && from + len > borrowed_at) n = from < borrowed_at ? borrowed_at - from : 0;
+    memcpy(dst, storage + from, n);
+    if (n < len) memcpy(dst + n, borrowed + (from + n - borrowed_at), len - n);
+  }
 
   Packet &read(uint8_t *p, uint16_t len) {
     assert(position + len <= limit);
@@ -70,7 +127,7 @@ class Packet : public Ring<Packet>, public FlipBuffer {
   }
 
   Packet &write(const uint8_t *p, uint16_t len) {
-    assert(position + len <= limit);
+    assert(borrowed == 0 && position + len <= limit);
     memcpy(storage + position, p, len);
     position += len;
     return *this;
@@ -130,18 +187,12 @@ class Packet : public Ring<Packet>, public FlipBuffer {
     }
 
     seek(0);
-
-    if (title) {
-#ifdef DEBUG
-      debug("%s:\n", title);
-      dump();
-#endif
-      title = 0;
-    }
   }
 
   enum {
     HCI_HEADER_SIZE = 1,
+    COMMAND_HEADER_SIZE = HCI_HEADER_SIZE + 3,
+    EVENT_HEADER_SIZE = HCI_HEADER_SIZE + 2,
     ACL_HEADER_SIZE = HCI_HEADER_SIZE + 4,
     L2CAP_HEADER_SIZE = ACL_HEADER_SIZE + 4
   };
@@ -169,7 +220,12 @@ class Packet : public Ring<Packet>, public FlipBuffer {
   void dump() {
     void dump_hex_bytes(uint8_t *, size_t);
 
-    dump_hex_bytes((uint8_t *) *this, get_remaining());
+    if (borrowed && position < borrowed_at) {
+      dump_hex_bytes((uint8_t *) *this, borrowed_at - position);
+      dump_hex_bytes((uint8_t *) borrowed, limit - borrowed_at);
+    } else {
+      dump_hex_bytes((uint8_t *) fragment(), get_remaining());
+    }
     debug("\n");
   }
 };
@@ -184,9 +240,79 @@ class SizedPacket : public Packet {
 template<unsigned int packet_size, unsigned int packet_count>
 class PacketPool : public Pool<SizedPacket<packet_size>, packet_count> {
  public:
-  PacketPool() : Pool<SizedPacket<packet_size>, packet_count>() {
+  PacketPool(const char *name = 0) : Pool<SizedPacket<packet_size>, packet_count>(name) {
+    this->item_size = packet_size; // what it holds, not the Packet around it
     for (unsigned int i=0; i < packet_count; ++i) {
-      this->pool[i].free_packets = (Ring<Packet> *) &this->available;
+      this->pool[i].pool = (PoolBase<Packet> *) this;
     }
   }
 };
+
+/*
+ * Packets in a few size classes, each with its own pool. allocate()
+ * takes the smallest free packet that holds the given length, so a short
+ * PDU doesn't tie up a long buffer, and moves up a size when the smaller
+ * ones have run out. Callers that can wait may leave a few packets of
+ * each size for ones that can't.
+ */
+class PacketAllocator {
+ public:
+  struct SizeClass {
+    PoolBase<Packet> *pool;
+    uint16_t packet_size;
+  };
+
+ private:
+  const SizeClass *const classes; // smallest first
+  const uint8_t count;
+
+ public:
+  PacketAllocator(const SizeClass *c, uint8_t n) : classes(c), count(n) {}
+
+  Packet *allocate(uint16_t length, uint32_t reserve = 0) {
+    for (uint8_t i=0; i < count; ++i) {
+      if (classes[i].packet_size < length) continue;
+
+      Packet *p = classes[i].pool->allocate(reserve);
+      if (p) return p;
+    }
+
+    return 0;
+  }
+
+  uint16_t largest() const {return classes[count - 1].packet_size;}
+
+  uint32_t capacity() const {
+    uint32_t n = 0;
+    for (uint8_t i=0; i < count; ++i) n += classes[i].pool->capacity;
+    return n;
+  }
+
+  uint8_t size_classes() const {return count;}
+  const SizeClass &size_class(uint8_t i) const {return classes[i];}
+};
+
+template<unsigned int small_size, unsigned int small_count,
+         unsigned int large_size, unsigned int large_count>
+class TieredPacketPool : public PacketAllocator {
+  PacketPool<small_size, small_count> small;
+  PacketPool<large_size, large_count> large;
+  SizeClass tiers[2];
+
+ public:
+  TieredPacketPool(const char *name = 0) :
+    PacketAllocator(tiers, 2),
+    small(name),
+    large(name)
+  {
+    tiers[0].pool = (PoolBase<Packet> *) &small;
+    tiers[0].packet_size = small_size;
+    tiers[1].pool = (PoolBase<Packet> *) &large;
+    tiers[1].packet_size = large_size;
+  }
+
+  void reset() {
+    small.reset();
+    large.reset();
+  }
+};
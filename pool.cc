@@ -0,0 +1,43 @@
+#include <cstring>
+
+#include "pool.h"
+
+PoolStatistics *PoolStatistics::all = 0;
+
+PoolStatistics::PoolStatistics(uint32_t cap, uint16_t size, const char *n) :
+  next(0),
+  name(n),
+  capacity(cap),
+  item_size(size),
+  in_use(0),
+  high_water(0),
+  allocations(0),
+  failures(0)
+{
+  // at the end, so they're reported in the order they were constructed
+  PoolStatistics **p = &all;
+  while (*p) p = &(*p)->next;
+  *p = this;
+}
+
+/*
+ * Each counter is read whole, but interrupts aren't held off for the lot,
+ * so a record can be an allocation or two out of step with itself.
+ */
+uint16_t PoolStatistics::snapshot(Record *records, uint16_t n) {
+  uint16_t i = 0;
+
+  for (PoolStatistics *p = all; p && i < n; p = p->next, ++i) {
+    Record &r = records[i];
+
+    strncpy(r.name, p->name ? p->name : "", sizeof(r.name));
+    r.item_size = p->item_size;
+    r.capacity = (uint16_t) p->capacity;
+    r.in_use = (uint16_t) p->in_use;
+    r.high_water = (uint16_t) p->high_water;
+    r.failures = (uint16_t) p->failures;
+    r.allocations = p->allocations;
+  }
+
+  return i;
+}
@@ -2,41 +2,81 @@
 
 #include <stdint.h>
 #include "ring.h"
+#include "critical.h"
+
+/*
+ * What every pool keeps about its occupancy, whatever it holds. Pools put
+ * themselves on one list as they're constructed, so all of them can be
+ * reported at run time (e.g. through a debug GATT characteristic) and
+ * sized from what they're really asked for.
+ */
+class PoolStatistics {
+  static PoolStatistics *all;
+  PoolStatistics *next;
+
+ public:
+  const char *name; // of its owner, or 0
+  const uint32_t capacity;
+  uint16_t item_size;
+
+  // occupancy statistics
+  uint32_t in_use, high_water;
+  uint32_t allocations, failures; // failures found the pool empty
+
+  // one pool as reported, little-endian
+  struct Record {
+    char name[8]; // padded with zeros, and not terminated if it's full
+    uint16_t item_size;
+    uint16_t capacity, in_use, high_water, failures;
+    uint32_t allocations;
+  } __attribute__ ((packed));
+
+  PoolStatistics(uint32_t cap, uint16_t size, const char *n);
+
+  void reset_statistics() {
+    high_water = in_use;
+    allocations = failures = 0;
+  }
+
+  static uint16_t snapshot(Record *records, uint16_t n); // returns the pools reported
+};
 
 template<class T>
-class PoolBase {
+class PoolBase : public PoolStatistics {
  public:
   Ring<T> available;
-  const uint32_t capacity;
 
-  PoolBase(uint32_t cap) : capacity(cap) {}
+  PoolBase(uint32_t cap, const char *n) : PoolStatistics(cap, sizeof(T), n) {}
 
-  T *allocate() {
-    T *p = available.begin();
-    if (p == available.end()) return 0;
+  // the UART ISR allocates and frees packets too. Fails if no more than
+  // reserve items are free.
+  T *allocate(uint32_t reserve = 0) {
+    T *p;
 
-#ifdef __arm__
-    __asm("cpsid i");
-#endif
-    p->join(p);
-    p->reset();
+    {
+      CriticalSection masked;
 
-#ifdef __arm__
-    __asm("cpsie i");
-#endif
+      p = available.begin();
+      if (p == available.end() || capacity - in_use <= reserve) {
+        failures += 1;
+        return 0;
+      }
+
+      p->join(p);
+      allocations += 1;
+      if (++in_use > high_water) high_water = in_use;
+    }
+
+    p->reset(); // it's ours now
     return p;
   }
 
   void deallocate(T *p) {
     assert(p != 0);
 
-#ifdef __arm__
-    __asm("cpsid i");
-#endif
+    CriticalSection masked;
     ((Ring<T> *) p)->join(&available);
-#ifdef __arm__
-    __asm("cpsie i");
-#endif
+    in_use -= 1;
   }
 };
 
@@ -46,16 +86,19 @@ class Pool : public PoolBase<T> {
   T pool[size];
 
  public:
-  Pool() :
-    PoolBase<T>(size)
+  Pool(const char *name = 0) :
+    PoolBase<T>(size, name)
   {
     reset();
   }
 
   void reset() {
+    CriticalSection masked;
+
     for (unsigned int i=0; i < size; ++i) {
       Ring<T> *p = (Ring<T> *) (pool + i);
       p->join(&this->available);
     }
+    this->in_use = 0;
   }
 };
@@ -1,6 +1,4 @@
 #ifdef DEBUG
-#include <cstdio>
-#include <stdarg.h>
 #include "screen.h"
 
 bool pinout_has_been_set = false;
@@ -74,13 +72,4 @@ void Screen::text(const char *chars) {
 
   GrFlush(&context);
 }
-
-void Screen::debug_(const char *format, ...) {
-  va_list args;
-  va_start(args, format);
-  char buffer[256];
-  vsprintf(buffer, format, args);
-  va_end(args);
-  text(buffer);
-}
 #endif
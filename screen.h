@@ -21,7 +21,6 @@ class Screen {
   void initialize();
   void clear();
   void text(const char *chars);
-  void debug_(const char *format, ...);
 
   static Screen the_screen;
 };
@@ -2,38 +2,64 @@
 #include "assert.h"
 #include "debug.h"
 
-Packet *Script::allocate_packet() {
-  return h4.command_packets.allocate();
+Packet *Script::allocate_packet(uint16_t length) {
+  return h4.command_packets.allocate(length, H4Tranceiver::EVENT_RESERVE);
 }
 
+// the controller decides when the command goes out
 void Script::send(Packet *p) {
-  p->join(&h4.packets_to_send);
-  h4.fill_uart();
+  h4.controller->send(p);
 }
 
 CannedScript::CannedScript(H4Tranceiver &t, const uint8_t *bytes, uint16_t length) :
   Script(t),
-  bytes((uint8_t *) bytes, length),
+  source(bytes, length),
+  header_staged(false),
   last_opcode(0),
-  state(&next_canned_command)
+  pending_count(0),
+  state(&send_canned_commands)
 {
 }
 
 bool CannedScript::is_complete() const {
-  return bytes.get_remaining() == 0 && last_opcode == 0;
+  return !header_staged && source.at_end() && pending_count == 0;
 }
 
 bool CannedScript::is_pending() const {
-  return last_opcode != 0;
+  return pending_count != 0;
+}
+
+bool CannedScript::expects(uint16_t opcode) const {
+  for (uint8_t i=0; i < pending_count; ++i) {
+    if (pending[i] == opcode) return true;
+  }
+
+  return false;
+}
+
+// forgets the oldest pending command with this opcode
+bool CannedScript::retire(uint16_t opcode) {
+  for (uint8_t i=0; i < pending_count; ++i) {
+    if (pending[i] == opcode) {
+      pending_count -= 1;
+      memmove(pending + i, pending + i + 1, (pending_count - i)*sizeof(pending[0]));
+      return true;
+    }
+  }
+
+  return false;
+}
+
+bool CannedScript::must_complete(uint16_t opcode) const {
+  return opcode == OPCODE_RESET || opcode == OPCODE_PAN13XX_CHANGE_BAUD_RATE;
 }
 
 bool CannedScript::command_complete(uint16_t opcode, Packet *p) {
-  if (opcode == last_opcode) {
+  if (retire(opcode)) {
     uint8_t status;
 
     *p >> status;
     debug("opcode 0x%04x status=0x%02x\n", opcode, status);
-    last_opcode = 0;
     p->deallocate();
     next();
     return true;
@@ -42,9 +68,11 @@ bool CannedScript::command_complete(uint16_t opcode, Packet *p) {
   }
 }
 
+// a command answered by Command Status gets no Command Complete
 bool CannedScript::command_status(uint16_t opcode, Packet *p) {
-  if (opcode == last_opcode) {
+  if (retire(opcode)) {
     p->deallocate();
+    next();
     return true;
   } else {
     return false;
@@ -52,8 +80,10 @@ bool CannedScript::command_status(uint16_t opcode, Packet *p) {
 }
 
 void CannedScript::restart() {
-  bytes.rewind();
+  source.rewind();
+  header_staged = false;
   last_opcode = 0;
+  pending_count = 0;
 }
 
 void CannedScript::send(Packet *p) {
@@ -61,36 +91,51 @@ void CannedScript::send(Packet *p) {
   Script::send(p);
 }
 
-Packet *CannedScript::next_canned_command() {
-  if (bytes.get_remaining() > 0) {
-    assert(bytes.get_remaining() >= 4);
-    assert(last_opcode == 0);
+void CannedScript::send_canned_commands() {
+  while (pending_count < MAX_PENDING) {
+    if (pending_count > 0 && must_complete(pending[pending_count - 1])) break;
+    if (next_canned_command() == 0) break;
+  }
+}
 
-    Packet *p = allocate_packet();
-    assert(p != 0);
+// zero at the end of the script, or if there's no packet for the next command yet
+Packet *CannedScript::next_canned_command() {
+  if (!header_staged) {
+    if (source.at_end()) return 0;
 
-    uint8_t indicator, parameter_length, *start;
-    
-    start = (uint8_t *) bytes;
-    bytes >> indicator >> last_opcode >> parameter_length;
+    uint16_t n __attribute__ ((unused)) = source.read(header, sizeof(header));
+    assert(n == sizeof(header) && header[0] == COMMAND_PACKET);
+    header_staged = true;
+  }
 
-    assert(bytes.get_remaining() >= parameter_length);
+  uint16_t opcode = header[1] + (header[2] << 8);
+  uint8_t parameter_length = header[3];
+  Packet *p = allocate_packet(sizeof(header) + parameter_length);
 
-    p->reset();
-    p->write(start, 4 + parameter_length);
-    p->flip();
+  if (p == 0) {
+    // try again when a pending command completes
+    assert(pending_count > 0);
+    return 0;
+  }
 
-    send(p);
+  p->reset();
+  p->write(header, sizeof(header));
+  uint16_t n __attribute__ ((unused)) = source.read((uint8_t *) *p, parameter_length);
+  assert(n == parameter_length);
+  p->skip(parameter_length);
+  p->flip();
+  header_staged = false;
+
+  if (opcode == OPCODE_PAN13XX_CHANGE_BAUD_RATE) {
+    assert(parameter_length == sizeof(baud_rate));
+    p->seek(sizeof(header));
+    *p >> baud_rate;
+    p->rewind();
+  }
 
-    if (last_opcode == OPCODE_PAN13XX_CHANGE_BAUD_RATE) {
-      assert(parameter_length == sizeof(baud_rate));
-      bytes >> baud_rate;
-    } else {
-      bytes.skip(parameter_length);
-    }
+  last_opcode = opcode;
+  pending[pending_count++] = opcode;
+  send(p);
 
-    return p;
-  } else {
-    return 0;
-  }
+  return p;
 }
@@ -2,12 +2,13 @@
 
 #include <stdint.h>
 #include "h4.h"
+#include "lzss.h"
 
 class Script {
  protected:
   H4Tranceiver &h4;
   virtual void send(Packet *p);
-  Packet *allocate_packet();
+  Packet *allocate_packet(uint16_t length);
 
  public:
   Script(H4Tranceiver &t) : h4(t) {}
@@ -20,15 +21,33 @@ class Script {
   virtual void next() = 0;
 };
 
+/*
+ * Sends the commands in a script, up to MAX_PENDING of them ahead of
+ * their completions. The host controller holds them until the baseband
+ * has room, so this only saves time if the baseband takes more than one
+ * at once. Commands whose results change how later ones are sent (a
+ * baud rate change, for example) are completed before anything else.
+ * Scripts are stored compressed, and expanded a command at a time.
+ */
 class CannedScript : public Script {
  protected:
-  Packet bytes;
-  uint16_t last_opcode;
+  enum {MAX_PENDING = 3};
+
+  LZSS source;
+  uint8_t header[Packet::COMMAND_HEADER_SIZE]; // of the next command
+  bool header_staged;             // but not yet sent
+  uint16_t last_opcode;           // of the command most recently sent
+  uint16_t pending[MAX_PENDING];  // sent but not completed, oldest first
+  uint8_t pending_count;
   uint32_t baud_rate;
   void (*state)(CannedScript *);
 
  protected:
+  void send_canned_commands();
   Packet *next_canned_command();
+  bool expects(uint16_t opcode) const;
+  bool retire(uint16_t opcode);
+  virtual bool must_complete(uint16_t opcode) const;
   virtual void send(Packet *p);
 
  public:
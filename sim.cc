@@ -0,0 +1,608 @@
+#ifndef __arm__
+#include <cstdio>
+#include <cstdlib>
+#include <unistd.h>
+#include <thread>
+
+#include "hal.h"
+#include "hal_host.h"
+#include "hci.h"
+#include "h4.h"
+#include "att.h"
+#include "gatt.h"
+#include "debug_service.h"
+#include "virtual_controller.h"
+#include "trace.h"
+#include "snoop.h"
+#include "spsc.h"
+
+/*
+ * Host build of the Bluetooth stack. The UART_1 peripheral is an
+ * in-memory model (hal_host.cc) whose far end is a VirtualController,
+ * so boot time and ATT throughput can be measured without a board.
+ */
+
+IOPin pc4('C', 4, IOPin::OUTPUT);
+UART_1 uart1;
+BBand pan1323(uart1, pc4);
+H4Tranceiver h4(&uart1);
+ATT_Channel att_channel(pan1323);
+
+AttributeDatabase database(GATT::standard_services);
+
+#ifdef DEBUG
+AttributeDatabase debug_attributes(DebugService::attributes);
+#endif
+
+enum {BENCH_ATTRIBUTES = 512}; // room for sim -b
+ATTRIBUTE_TABLE(GATT::STANDARD_ATTRIBUTES + DebugService::ATTRIBUTES + BENCH_ATTRIBUTES);
+
+static uint64_t isr_nsec = 0;
+static uint32_t isr_count = 0;
+
+extern "C" const uint8_t bluetooth_init_cc2564_credits[];
+extern uint32_t bluetooth_init_cc2564_credits_size;
+
+extern "C" void uart_1_handler() {
+  uint64_t t = NVIC::nanoseconds();
+  h4.uart_interrupt();
+  isr_nsec += NVIC::nanoseconds() - t;
+  isr_count += 1;
+}
+
+static FILE *capture = 0;
+
+// writes out the HCI traffic captured so far, as the device does from its main loop
+static void drain_capture() {
+#ifdef SNOOP
+  uint16_t n;
+  const uint8_t *bytes;
+
+  while (capture && (bytes = Snoop::pending(n), n > 0)) Snoop::consume(fwrite(bytes, 1, n, capture));
+#endif
+}
+
+static bool verbose = false;
+
+static void show(const char *line) {
+  fputs(line, stdout);
+}
+
+// what the device's main loop does between packets
+static void idle() {
+  drain_capture();
+#ifdef DEBUG
+  DebugService::refresh();
+  while (Log::drain(verbose ? show : 0));
+#endif
+}
+
+static void reset_packet_statistics(PacketAllocator &packets) {
+  for (uint8_t i=0; i < packets.size_classes(); ++i) packets.size_class(i).pool->reset_statistics();
+}
+
+static void print_packet_statistics(const char *name, PacketAllocator &packets) {
+  for (uint8_t i=0; i < packets.size_classes(); ++i) {
+    const PacketAllocator::SizeClass &c = packets.size_class(i);
+
+    printf("     %s packets of %4u bytes: high water %u/%u, %u allocations, %u found none free\n",
+           name, c.packet_size, c.pool->high_water, c.pool->capacity, c.pool->allocations, c.pool->failures);
+  }
+}
+
+/*
+ * Adds services of 8 characteristics each (17 attributes per service)
+ * while the total stays within n attributes, then times the lookups that
+ * GATT discovery makes: primary services by type, characteristics by
+ * type, a service by its UUID, and the device name by type.
+ */
+static void lookup_benchmark(uint32_t n) {
+  const uint32_t per_service = 1 + 8*Characteristic<uint32_t>::ATTRIBUTES;
+  uint16_t last_service = 0;
+
+  while (AttributeBase::count() + per_service <= n) {
+    last_service = 0x1900 + AttributeBase::count();
+    new Attribute<uint16_t>(GATT::PRIMARY_SERVICE, last_service);
+    for (uint16_t i=0; i < 8; ++i) new Characteristic<uint32_t>(0x2b00 + i);
+  }
+
+  const uint32_t sweeps = 200;
+  uint32_t lookups = 0, found = 0;
+  uint64_t t0 = NVIC::nanoseconds();
+
+  for (uint32_t i=0; i < sweeps; ++i) {
+    for (uint16_t h=1; (h = AttributeBase::find_by_type(h, GATT::PRIMARY_SERVICE)) != 0; ++h) {
+      lookups += 1;
+      found += 1;
+    }
+    lookups += 1;
+
+    for (uint16_t h=1; (h = AttributeBase::find_by_type(h, GATT::CHARACTERISTIC)) != 0; ++h) {
+      lookups += 1;
+      found += 1;
+    }
+    lookups += 1;
+
+    for (uint16_t h=1; (h = AttributeBase::find_by_type_value(h, GATT::PRIMARY_SERVICE, &last_service, 2)) != 0; ++h) {
+      lookups += 1;
+      found += 1;
+    }
+    lookups += 1;
+
+    for (uint16_t h=1; (h = AttributeBase::find_by_type(h, GATT::DEVICE_NAME)) != 0; ++h) {
+      lookups += 1;
+      found += 1;
+    }
+    lookups += 1;
+  }
+
+  uint64_t t1 = NVIC::nanoseconds();
+
+  printf("lookup: %u attributes, %u lookups finding %u handles per sweep: %.1f usec per sweep, %.0f nsec per lookup\n",
+         AttributeBase::count(), lookups/sweeps, found/sweeps, (t1 - t0)/(sweeps*1e3), (double) (t1 - t0)/lookups);
+}
+
+/*
+ * The 16 byte representation that UUID replaced (UUID itself is 8 bytes
+ * on the target), kept to measure the difference. Every comparison is a memcmp, and comparing with a 16-bit
+ * UUID checks the Bluetooth base first.
+ */
+struct FullUUID {
+  uint8_t data[UUID::LENGTH];
+
+  FullUUID() {}
+  FullUUID(const UUID &u) {u.write(data);}
+
+  bool is_16bit() const {
+    static const FullUUID base((uint16_t) 0);
+    return !memcmp(data, base.data, 12) && !memcmp(data + 14, base.data + 14, 2);
+  }
+  bool operator==(uint16_t other) const {return is_16bit() && other == data[12] + (data[13] << 8);}
+  bool operator==(const FullUUID &other) const {return 0 == compare(*this, other);}
+  static int compare(const FullUUID &u1, const FullUUID &u2) {return memcmp(u1.data, u2.data, sizeof(u1.data));}
+};
+
+template<typename T>
+struct TypeTable {
+  enum {CAPACITY = GATT::STANDARD_ATTRIBUTES + BENCH_ATTRIBUTES};
+
+  T types[CAPACITY]; // type of handle h is at h-1
+  uint16_t by_type[CAPACITY];
+  uint16_t n;
+
+  bool precedes(uint16_t h1, uint16_t h2) const {
+    int c = T::compare(types[h1 - 1], types[h2 - 1]);
+    return c < 0 || (c == 0 && h1 < h2);
+  }
+
+  TypeTable() : n(AttributeBase::count()) {
+    for (uint16_t h=1; h <= n; ++h) {
+      types[h - 1] = AttributeBase::get(h)->type;
+      by_type[h - 1] = h;
+    }
+
+    // insertion sort, which keeps this free of comparator objects
+    for (uint16_t i=1; i < n; ++i) {
+      uint16_t h = by_type[i], j = i;
+      for (; j > 0 && precedes(h, by_type[j - 1]); --j) by_type[j] = by_type[j - 1];
+      by_type[j] = h;
+    }
+  }
+
+  // the first handle >= start of the given type, as AttributeBase::find_by_type
+  uint16_t find_by_type(uint16_t start, const T &type) const {
+    const uint16_t *first = by_type, *last = by_type + n;
+
+    while (first < last) {
+      const uint16_t *middle = first + (last - first)/2;
+      int c = T::compare(types[*middle - 1], type);
+
+      if (c < 0 || (c == 0 && *middle < start)) first = middle + 1;
+      else                                      last = middle;
+    }
+
+    return (first < by_type + n && types[*first - 1] == type) ? *first : 0;
+  }
+
+  // the same, by scanning every handle
+  uint16_t scan_by_type(uint16_t start, uint16_t type) const {
+    for (uint16_t h=start; h <= n; ++h) if (types[h - 1] == type) return h;
+    return 0;
+  }
+};
+
+template<typename T>
+static void representation_benchmark(const char *name) {
+  static TypeTable<T> table;
+  const T targets[] = {
+    UUID(GATT::PRIMARY_SERVICE), UUID(GATT::CHARACTERISTIC), UUID(GATT::DEVICE_NAME),
+    UUID("f000aa00-0451-4000-b000-000000000000")
+  };
+  const uint16_t short_targets[] = {GATT::PRIMARY_SERVICE, GATT::CHARACTERISTIC, GATT::DEVICE_NAME};
+  const uint32_t sweeps = 200;
+  uint32_t lookups = 0, scans = 0;
+
+  uint64_t t0 = NVIC::nanoseconds();
+
+  for (uint32_t i=0; i < sweeps; ++i) {
+    for (uint32_t j=0; j < sizeof(targets)/sizeof(targets[0]); ++j) {
+      for (uint16_t h=1; (h = table.find_by_type(h, targets[j])) != 0; ++h) lookups += 1;
+      lookups += 1;
+    }
+  }
+
+  uint64_t t1 = NVIC::nanoseconds();
+
+  for (uint32_t i=0; i < sweeps; ++i) {
+    for (uint32_t j=0; j < sizeof(short_targets)/sizeof(short_targets[0]); ++j) {
+      for (uint16_t h=1; (h = table.scan_by_type(h, short_targets[j])) != 0; ++h) scans += 1;
+      scans += 1;
+    }
+  }
+
+  uint64_t t2 = NVIC::nanoseconds();
+
+  printf("%s: %.0f nsec per indexed lookup, %.0f nsec per scanned lookup\n",
+         name, (double) (t1 - t0)/lookups, (double) (t2 - t1)/scans);
+}
+
+// sends count notifications of the device name as fast as the controller's buffers allow
+static void notification_benchmark(VirtualController &controller, uint32_t count) {
+  controller.limit = 0;
+
+  while (!pan1323.is_connected(controller.connection_handle)) {
+    pan1323.process_incoming_packets();
+    idle();
+    NVIC::wait(1000);
+  }
+
+  for (uint32_t sent=0; sent < count;) {
+    pan1323.process_incoming_packets();
+    idle();
+    if (att_channel.notify(controller.connection_handle, 3)) sent += 1;
+    else NVIC::wait(1000); // for a Number Of Completed Packets event
+  }
+
+  while (controller.notifications < count) {
+    pan1323.process_incoming_packets();
+    idle();
+    NVIC::wait(1000);
+  }
+}
+
+#ifdef TRACE
+static double usec(uint32_t cycles) {
+  return cycles/(CPU::get_clock_rate()/1e6);
+}
+
+/*
+ * Follows each ACL packet from the controller (an ATT request) through
+ * the trace to the ACL packet sent in response. Requests are answered in
+ * order, so the nth of each stage belongs to the nth request.
+ */
+static void print_trace_statistics() {
+  static const uint8_t path[] = {Trace::RX_START, Trace::RX_QUEUED, Trace::DISPATCH, Trace::TX_QUEUED, Trace::TX_DONE};
+  const uint32_t stages = sizeof(path);
+  std::vector<uint32_t> at[stages];
+  uint32_t i = 0, n = Trace::count();
+  uint64_t isr_cycles = 0, handler_cycles = 0;
+  uint32_t isrs = 0, handled = 0, isr_max = 0, handler_max = 0, entered = 0, dispatched = 0;
+  bool in_isr = false, in_handler = false;
+
+  if (Trace::recorded() > n) {
+    printf("trace: kept the last %u of %u records\n", n, Trace::recorded());
+    // start with a request, not part way through one
+    while (i < n && !(Trace::get(i).stage == Trace::RX_START && Trace::get(i).indicator == HCI::ACL_PACKET)) ++i;
+  }
+
+  for (; i < n; ++i) {
+    const Trace::Record &r = Trace::get(i);
+
+    switch (r.stage) {
+    case Trace::ISR_ENTER : entered = r.cycles; in_isr = true; break;
+    case Trace::DISPATCH  : dispatched = r.cycles; in_handler = true; break;
+
+    case Trace::ISR_EXIT :
+      if (!in_isr) break;
+      isr_cycles += r.cycles - entered;
+      isr_max = std::max(isr_max, r.cycles - entered);
+      isrs += 1;
+      in_isr = false;
+      break;
+
+    case Trace::HANDLED :
+      if (!in_handler) break;
+      handler_cycles += r.cycles - dispatched;
+      handler_max = std::max(handler_max, r.cycles - dispatched);
+      handled += 1;
+      in_handler = false;
+      break;
+    }
+
+    if (r.indicator != HCI::ACL_PACKET) continue;
+
+    for (uint32_t s=0; s < stages; ++s) {
+      // a stage only counts for a request that's been through the ones before
+      if (r.stage == path[s] && (s == 0 || at[s].size() < at[s - 1].size())) at[s].push_back(r.cycles);
+    }
+  }
+
+  printf("trace: %u uart interrupts, %.2f usec avg, %.2f max; %u packets handled, %.2f usec avg, %.2f max\n",
+         isrs, isrs ? usec(isr_cycles)/isrs : 0, usec(isr_max),
+         handled, handled ? usec(handler_cycles)/handled : 0, usec(handler_max));
+
+  uint32_t requests = at[stages - 1].size();
+  if (requests == 0) return;
+
+  uint64_t total[stages] = {0};
+  uint32_t latency_min = ~0U, latency_max = 0;
+
+  for (uint32_t r=0; r < requests; ++r) {
+    for (uint32_t s=1; s < stages; ++s) total[s] += at[s][r] - at[s - 1][r];
+
+    uint32_t latency = at[stages - 1][r] - at[0][r];
+    latency_min = std::min(latency_min, latency);
+    latency_max = std::max(latency_max, latency);
+  }
+
+  uint64_t latency = 0;
+  for (uint32_t s=1; s < stages; ++s) latency += total[s];
+
+  printf("     %u att requests answered in %.2f usec avg, %.2f min, %.2f max\n",
+         requests, usec(latency)/requests, usec(latency_min), usec(latency_max));
+  printf("     receiving %.2f, queued %.2f, handling %.2f, sending %.2f usec avg\n",
+         usec(total[1])/requests, usec(total[2])/requests, usec(total[3])/requests, usec(total[4])/requests);
+}
+
+static void dump_trace() {
+  uint32_t start = Trace::count() ? Trace::get(0).cycles : 0;
+
+  for (uint32_t i=0; i < Trace::count(); ++i) {
+    const Trace::Record &r = Trace::get(i);
+    printf("%12.2f %-10s 0x%02x %u\n", usec(r.cycles - start), Trace::name(r.stage), r.indicator, r.length);
+  }
+}
+#endif
+
+/*
+ * Passes count values from one thread to another through an SPSCQueue
+ * the size of packets_received, as the UART ISR and main loop pass
+ * packets, except that here the two really do run at once.
+ */
+static void queue_benchmark(uint32_t count) {
+  static SPSCQueue<uint32_t, 32> queue;
+  uint32_t full = 0, empty = 0, out_of_order = 0;
+
+  uint64_t t0 = NVIC::nanoseconds();
+
+  std::thread producer([&]() {
+    for (uint32_t i=0; i < count;) {
+      if (queue.push(i)) {
+        i += 1;
+      } else {
+        full += 1;
+        std::this_thread::yield(); // there may be only one core
+      }
+    }
+  });
+
+  for (uint32_t expected=0; expected < count;) {
+    uint32_t x;
+
+    if (!queue.pop(x)) {
+      empty += 1;
+      std::this_thread::yield();
+      continue;
+    }
+
+    if (x != expected) out_of_order += 1;
+    expected += 1;
+  }
+
+  producer.join();
+  uint64_t t1 = NVIC::nanoseconds();
+
+  printf("spsc: %u values in %.3f s: %.1f million/s, %u out of order, found full %u and empty %u times\n",
+         count, (t1 - t0)/1e9, count/((t1 - t0)/1e3), out_of_order, full, empty);
+}
+
+static void usage() {
+  fprintf(stderr, "usage: sim [-n requests] [-w window] [-r requests/sec] [-a handle] [-s pdu size] [-l] [-d] [-b attributes]\n"
+          "           [-t notifications] [-c completions/sec] [-q commands] [-R] [-T] [-S btsnoop file] [-v]\n"
+          "           [-Q values] [-x unanswered command] [-g]\n");
+  exit(1);
+}
+
+int main(int argc, char *argv[]) {
+  UARTModel &model = *NVIC::uart(1);
+  VirtualController controller(model);
+  bool dma = false;
+  bool restart = false;
+  bool dump = false;
+  uint32_t notifications = 0;
+  int c;
+
+  controller.limit = 20000;
+
+  while ((c = getopt(argc, argv, "n:w:r:a:s:ldb:t:c:q:RTS:vQ:x:g")) != -1) {
+    switch (c) {
+    case 'n' : controller.limit = strtoul(optarg, 0, 0); break;
+    case 'w' : controller.window = strtoul(optarg, 0, 0); break;
+    case 'r' : controller.requests_per_second = strtoul(optarg, 0, 0); break;
+    case 'a' : controller.attribute_handle = strtoul(optarg, 0, 0); break;
+    case 's' : controller.request_size = strtoul(optarg, 0, 0); break;
+    case 'l' : model.line_rate = true; break;
+    case 'd' : dma = true; break;
+    case 't' : notifications = strtoul(optarg, 0, 0); break;
+    case 'c' : controller.completions_per_second = strtoul(optarg, 0, 0); break;
+    case 'q' : controller.command_credits = strtoul(optarg, 0, 0); break;
+    case 'x' : controller.unanswered_command = strtoul(optarg, 0, 0); break;
+    case 'g' : controller.discover = true; break;
+    case 'R' : restart = true; break;
+    case 'T' : dump = true; break;
+    case 'v' : verbose = true; break;
+    case 'Q' :
+      queue_benchmark(strtoul(optarg, 0, 0));
+      return 0;
+    case 'S' :
+      capture = fopen(optarg, "wb");
+      if (capture == 0) {
+        perror(optarg);
+        return 1;
+      }
+      break;
+    case 'b' :
+      if (strtoul(optarg, 0, 0) > BENCH_ATTRIBUTES) usage();
+      lookup_benchmark(strtoul(optarg, 0, 0));
+      representation_benchmark<FullUUID>("uuid (16 bytes)");
+      representation_benchmark<UUID>("uuid (compact)");
+      return 0;
+    default  : usage();
+    }
+  }
+
+  controller.shutdown = &pc4;
+  controller.scripted_credits = bluetooth_init_cc2564_credits;
+  controller.scripted_credits_size = bluetooth_init_cc2564_credits_size;
+  model.attach(&controller);
+  NVIC::attach(uart1.interrupt, &uart_1_handler);
+  NVIC::start();
+
+  h4.set_controller(&pan1323);
+  h4.set_dma_enable(dma);
+
+  // no requests until the restart, which would cut one off mid-packet
+  uint32_t limit = controller.limit;
+  if (restart) controller.limit = 0;
+
+  uint64_t t0 = NVIC::nanoseconds();
+  pan1323.initialize();
+  uint64_t t1 = NVIC::nanoseconds();
+
+  if (!pan1323.booted) {
+    printf("boot: gave up after %u attempts\n", pan1323.boot_attempts);
+    return 1;
+  }
+
+  uint32_t boot_commands = controller.commands;
+  uint32_t boot_baud_changes = controller.baud_changes;
+  uint32_t boot_power_ups = controller.power_ups;
+  uint32_t restart_commands = 0, restart_power_ups = 0;
+  uint32_t cold_boot_usec = pan1323.cold_boot_usec;
+  uint32_t patch_usec = pan1323.patch_usec;
+  uint32_t warm_boot_usec = pan1323.warm_boot_usec;
+  uint64_t t2 = t1, t3 = t1;
+
+  if (restart) {
+    // initialize again, as software would after a fault, with the patch still loaded
+    t2 = NVIC::nanoseconds();
+    pan1323.initialize();
+    t3 = NVIC::nanoseconds();
+    restart_commands = controller.commands - boot_commands;
+    restart_power_ups = controller.power_ups - boot_power_ups;
+    controller.limit = limit;
+  }
+
+  uint64_t rx0 = model.rx_bytes, tx0 = model.tx_bytes;
+  isr_nsec = 0;
+  isr_count = 0;
+  NVIC::reset_masked_histogram();
+  reset_packet_statistics(h4.acl_packets);
+#ifdef TRACE
+  Trace::clear();
+#endif
+
+  if (notifications) notification_benchmark(controller, notifications);
+
+  while (!controller.is_finished()) {
+    pan1323.process_incoming_packets();
+    idle();
+    NVIC::wait(1000); // the last response raises no interrupt
+  }
+
+  NVIC::stop();
+  idle();
+
+  double seconds = (controller.last_response - controller.first_request)/1e9;
+
+  printf("boot: %u commands, %u baud changes, %u attempts in %.3f s\n",
+         boot_commands, boot_baud_changes, pan1323.boot_attempts, (t1 - t0)/1e9);
+  printf("     cold boot %.1f msec, patch %.1f msec, warm boot %.1f msec\n",
+         cold_boot_usec/1e3, patch_usec/1e3, warm_boot_usec/1e3);
+  if (restart) {
+    printf("restart: %u commands, %u power ups in %.3f s\n",
+           restart_commands, restart_power_ups, (t3 - t2)/1e9);
+    if (pan1323.patch_usec) {
+      printf("     cold boot %.1f msec, patch %.1f msec, warm boot %.1f msec\n",
+             pan1323.cold_boot_usec/1e3, pan1323.patch_usec/1e3, pan1323.warm_boot_usec/1e3);
+    } else {
+      printf("     patch kept after %.1f msec, warm boot %.1f msec\n",
+             pan1323.cold_boot_usec/1e3, pan1323.warm_boot_usec/1e3);
+    }
+  }
+  print_packet_statistics("command", h4.command_packets);
+  if (notifications) {
+    seconds = (controller.last_notification - controller.first_notification)/1e9;
+    printf("att: %u notifications in %.3f s: %.0f notifications/s, %u errors\n",
+           controller.notifications, seconds, controller.notifications/seconds, controller.errors);
+  } else if (controller.discover) {
+    printf("att: %u primary services in %u requests, %.3f s, %u errors\n",
+           (uint32_t) controller.services.size(), controller.responses, seconds, controller.errors);
+    for (size_t i=0; i < controller.services.size(); ++i) {
+      const VirtualController::Service &s = controller.services[i];
+      printf("     0x%04x-0x%04x: 0x%04x\n", s.start, s.end, s.uuid);
+    }
+  } else {
+    printf("att: %u reads of handle 0x%04x in %.3f s: %.0f transactions/s, %u errors\n",
+           controller.responses, controller.attribute_handle, seconds, controller.responses/seconds,
+           controller.errors);
+    printf("     window %u, max outstanding %u\n", controller.window, controller.max_outstanding);
+  }
+  print_packet_statistics("acl", h4.acl_packets);
+  printf("     controller buffered at most %u of %u acl packets, %u overruns\n",
+         controller.max_buffered, controller.le_acl_packets, controller.overruns);
+  printf("     %u requests held by flow control, %u acl and %u event packets dropped\n",
+         controller.flow_stalls, h4.dropped_acl, h4.dropped_events);
+  uint64_t bytes = (model.rx_bytes - rx0) + (model.tx_bytes - tx0);
+  printf("uart: %llu bytes in, %llu bytes out, %s\n",
+         (unsigned long long) (model.rx_bytes - rx0), (unsigned long long) (model.tx_bytes - tx0),
+         dma ? "uDMA" : "programmed I/O");
+  printf("     %u interrupts, %.3f per byte, %.1f nsec of ISR time per byte\n",
+         isr_count, (double) isr_count/bytes, (double) isr_nsec/bytes);
+
+#ifdef TRACE
+  print_trace_statistics();
+#endif
+
+  printf("interrupts masked (nsec: count):\n");
+  for (uint32_t i=0; i < NVIC::HISTOGRAM_BUCKETS; ++i) {
+    uint32_t n = NVIC::masked_count(i);
+    if (n) printf("     %10llu: %u\n", 1ULL << i, n);
+  }
+
+#ifdef DEBUG
+  if (verbose) {
+    // as the debug GATT characteristic reports them
+    printf("pools (since boot):\n");
+    for (uint16_t i=0; i < DebugService::REPORTED_POOLS && DebugService::pool_statistics[i].capacity; ++i) {
+      const PoolStatistics::Record &r = DebugService::pool_statistics[i];
+      printf("     %-8.8s %4u bytes: %u/%u in use, high water %u, %u allocations, %u found none free\n",
+             r.name, r.item_size, r.in_use, r.capacity, r.high_water, r.allocations, r.failures);
+    }
+  }
+#endif
+
+#ifdef TRACE
+  if (dump) dump_trace();
+#endif
+
+#ifdef SNOOP
+  if (capture) {
+    fclose(capture);
+    printf("snoop: %u packets dropped from the capture\n", Snoop::dropped);
+  }
+#endif
+
+  return 0;
+}
+#endif
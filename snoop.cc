@@ -0,0 +1,152 @@
+#ifdef SNOOP
+#include <string.h>
+#include <algorithm>
+
+#include "snoop.h"
+#include "packet.h"
+#include "hal.h"
+
+static_assert((Snoop::CAPACITY & (Snoop::CAPACITY - 1)) == 0, "SNOOP_CAPACITY must be a power of 2");
+
+uint8_t Snoop::ring[CAPACITY];
+volatile uint32_t Snoop::head = 0;
+uint32_t Snoop::tail = 0;
+uint8_t Snoop::out[BTSNOOP_HEADER + SNAP_LENGTH];
+uint16_t Snoop::out_position = 0;
+uint16_t Snoop::out_length = 0;
+bool Snoop::started = false;
+uint32_t Snoop::last_cycles = 0;
+uint32_t Snoop::cycle_remainder = 0;
+uint64_t Snoop::usec = 0;
+uint32_t Snoop::dropped = 0;
+
+// btsnoop flags
+enum {RECEIVED = 0x01, COMMAND_OR_EVENT = 0x02};
+
+// midnight, January 1 1970, in microseconds since the year 0
+static const uint64_t EPOCH = 0x00dcddb30f2f8000ULL;
+
+static void put_be32(uint8_t *p, uint32_t x) {
+  p[0] = x >> 24;
+  p[1] = x >> 16;
+  p[2] = x >> 8;
+  p[3] = x;
+}
+
+void Snoop::put(uint32_t at, const uint8_t *src, uint16_t length) {
+  uint32_t i = at & (CAPACITY - 1);
+  uint32_t n = std::min((uint32_t) length, CAPACITY - i);
+
+  memcpy(ring + i, src, n);
+  memcpy(ring, src + n, length - n);
+}
+
+void Snoop::get(uint32_t at, uint8_t *dst, uint16_t length) {
+  uint32_t i = at & (CAPACITY - 1);
+  uint32_t n = std::min((uint32_t) length, CAPACITY - i);
+
+  memcpy(dst, ring + i, n);
+  memcpy(dst + n, ring, length - n);
+}
+
+void Snoop::record(Packet *p, bool received) {
+  uint16_t length = p->get_limit();
+  uint16_t included = std::min(length, (uint16_t) SNAP_LENGTH);
+  uint8_t flags = received ? RECEIVED : 0;
+  uint8_t data[SNAP_LENGTH];
+
+  if (p->get(0) == HCI::COMMAND_PACKET || p->get(0) == HCI::EVENT_PACKET) flags |= COMMAND_OR_EVENT;
+  p->copy(0, data, included);
+
+#ifdef __arm__
+  // the UART ISR records too, so hold it off (whatever the PRIMASK was)
+  uint32_t primask;
+  asm volatile ("mrs %0, primask\n\tcpsid i" : "=r" (primask));
+#endif
+
+  uint32_t at = head;
+
+  if (CAPACITY - (at - tail) < (uint32_t) RECORD_HEADER + included) {
+    dropped += 1;
+  } else {
+    uint32_t cycles = CPU::cycles();
+    const uint8_t header[RECORD_HEADER] = {
+      (uint8_t) length, (uint8_t) ((length >> 8) | (flags << 6)), // packets are under 16K
+      (uint8_t) included, (uint8_t) (included >> 8),
+      (uint8_t) cycles, (uint8_t) (cycles >> 8), (uint8_t) (cycles >> 16), (uint8_t) (cycles >> 24)
+    };
+
+    put(at, header, RECORD_HEADER);
+    put(at + RECORD_HEADER, data, included);
+    head = at + RECORD_HEADER + included; // only now can it be drained
+  }
+
+#ifdef __arm__
+  asm volatile ("msr primask, %0" : : "r" (primask));
+#endif
+}
+
+// puts the file header or the next record in out, if there is one
+bool Snoop::stage() {
+  out_position = 0;
+
+  if (!started) {
+    static const uint8_t header[FILE_HEADER] = {
+      'b', 't', 's', 'n', 'o', 'o', 'p', 0,
+      0, 0, 0, 1,      // version
+      0, 0, 0x03, 0xea // datalink: HCI UART (H4)
+    };
+
+    memcpy(out, header, FILE_HEADER);
+    out_length = FILE_HEADER;
+    started = true;
+    return true;
+  }
+
+  if (head == tail) {
+    out_length = 0;
+    return false;
+  }
+
+  uint8_t header[RECORD_HEADER];
+  get(tail, header, RECORD_HEADER);
+
+  uint16_t length = header[0] + ((header[1] & 0x3f) << 8);
+  uint8_t flags = header[1] >> 6;
+  uint16_t included = header[2] + (header[3] << 8);
+  uint32_t cycles = header[4] + (header[5] << 8) + (header[6] << 16) + (header[7] << 24);
+
+  get(tail + RECORD_HEADER, out + BTSNOOP_HEADER, included);
+  tail += RECORD_HEADER + included;
+
+  // 32-bit arithmetic only, since it's the target's
+  uint32_t mhz = CPU::get_clock_rate()/1000000;
+  uint32_t elapsed = cycles - last_cycles;
+
+  last_cycles = cycles;
+  cycle_remainder += elapsed % mhz;
+  usec += elapsed/mhz + cycle_remainder/mhz;
+  cycle_remainder %= mhz;
+
+  uint64_t timestamp = EPOCH + usec;
+  put_be32(out + 0, length);
+  put_be32(out + 4, included);
+  put_be32(out + 8, flags);
+  put_be32(out + 12, dropped);
+  put_be32(out + 16, timestamp >> 32);
+  put_be32(out + 20, timestamp);
+  out_length = BTSNOOP_HEADER + included;
+  return true;
+}
+
+const uint8_t *Snoop::pending(uint16_t &length) {
+  if (out_position == out_length) stage();
+
+  length = out_length - out_position;
+  return out + out_position;
+}
+
+void Snoop::consume(uint16_t length) {
+  out_position += length;
+}
+#endif
@@ -0,0 +1,71 @@
+#pragma once
+
+#include <stdint.h>
+
+class Packet;
+
+#ifndef SNOOP_CAPACITY
+#define SNOOP_CAPACITY 4096
+#endif
+
+#ifndef SNOOP_SNAP_LENGTH
+#define SNOOP_SNAP_LENGTH 64
+#endif
+
+/*
+ * A capture of the HCI traffic in both directions, which reads out as a
+ * btsnoop file (datalink 1002, H4) that Wireshark opens. H4Tranceiver
+ * copies the first SNAP_LENGTH bytes of each packet into a ring in RAM
+ * as it's received or sent, stamped with CPU::cycles(); packets that
+ * don't fit are counted as dropped. The main loop drains it with
+ * pending() and consume(), which turn records into btsnoop, when it has
+ * nothing better to do. The time between drains mustn't exceed one lap
+ * of the cycle counter (86 sec at 50 MHz).
+ *
+ * Only built with SNOOP defined; otherwise snoop() calls compile to
+ * nothing. The device writes the file to UART0 from reset, so
+ *   stty -f /dev/cu.usbserial raw 115200; cat /dev/cu.usbserial > t.btsnoop
+ * captures it. The host sim writes it with -S.
+ */
+class Snoop {
+ public:
+  enum {
+    CAPACITY = SNOOP_CAPACITY, // a power of 2
+    SNAP_LENGTH = SNOOP_SNAP_LENGTH,
+    RECORD_HEADER = 8,         // as kept in the ring
+    FILE_HEADER = 16,
+    BTSNOOP_HEADER = 24        // of each btsnoop record
+  };
+
+ private:
+  static uint8_t ring[CAPACITY];
+  static volatile uint32_t head; // bytes written
+  static uint32_t tail;          // and read, as of the last record drained
+
+  // the btsnoop bytes being drained
+  static uint8_t out[BTSNOOP_HEADER + SNAP_LENGTH];
+  static uint16_t out_position, out_length;
+  static bool started;
+
+  // microseconds since the cycle counter started, as of the last record drained
+  static uint32_t last_cycles, cycle_remainder;
+  static uint64_t usec;
+
+  static void put(uint32_t at, const uint8_t *src, uint16_t length);
+  static void get(uint32_t at, uint8_t *dst, uint16_t length);
+  static bool stage();
+
+ public:
+  static uint32_t dropped;
+
+  static void record(Packet *p, bool received);
+
+  static const uint8_t *pending(uint16_t &length); // the next bytes to write out
+  static void consume(uint16_t length);            // the number written
+};
+
+#ifdef SNOOP
+#define snoop(...) Snoop::record(__VA_ARGS__)
+#else
+#define snoop(...)
+#endif
@@ -0,0 +1,52 @@
+#pragma once
+
+#include <stdint.h>
+
+/*
+ * A fixed-size queue with one producer and one consumer, which may
+ * interrupt each other (e.g., the UART ISR and the main loop), and which
+ * needn't mask interrupts to use it. Each side writes only its own
+ * index, and aligned 32-bit loads and stores are atomic, so it's enough
+ * to order the slot and index accesses with barriers. That's a DMB on
+ * the Cortex-M3; LDREX/STREX are only needed when a side has more than
+ * one writer.
+ */
+template<typename T, unsigned int size>
+class SPSCQueue {
+  static_assert((size & (size - 1)) == 0, "SPSCQueue size must be a power of 2");
+
+  T slots[size];
+  volatile uint32_t head; // items pushed, written only by the producer
+  volatile uint32_t tail; // and popped, written only by the consumer
+
+ public:
+  SPSCQueue() : head(0), tail(0) {}
+
+  bool empty() const {return head == tail;}
+
+  // producer side; false if the queue is full
+  bool push(const T &x) {
+    uint32_t h = head;
+
+    if (h - tail == size) return false;
+    slots[h & (size - 1)] = x;
+    __sync_synchronize(); // the slot is written before it's published
+    head = h + 1;
+    return true;
+  }
+
+  // consumer side; false if the queue is empty
+  bool pop(T &x) {
+    uint32_t t = tail;
+
+    if (head == t) return false;
+    __sync_synchronize(); // the slot is read after it's published
+    x = slots[t & (size - 1)];
+    __sync_synchronize(); // and before it's handed back
+    tail = t + 1;
+    return true;
+  }
+
+  // only while the producer is stopped
+  void clear() {tail = head;}
+};
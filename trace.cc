@@ -0,0 +1,35 @@
+#ifdef TRACE
+#include "trace.h"
+#include "hal.h"
+
+static_assert((Trace::CAPACITY & (Trace::CAPACITY - 1)) == 0, "TRACE_CAPACITY must be a power of 2");
+
+Trace::Record Trace::ring[CAPACITY];
+uint32_t Trace::next = 0;
+
+void Trace::record(stage s, uint8_t indicator, uint16_t length) {
+#ifdef __arm__
+  // the UART ISR records too, so hold it off (whatever the PRIMASK was)
+  uint32_t primask;
+  asm volatile ("mrs %0, primask\n\tcpsid i" : "=r" (primask));
+#endif
+
+  Record &r = ring[next++ & (CAPACITY - 1)];
+  r.cycles = CPU::cycles();
+  r.stage = s;
+  r.indicator = indicator;
+  r.length = length;
+
+#ifdef __arm__
+  asm volatile ("msr primask, %0" : : "r" (primask));
+#endif
+}
+
+const char *Trace::name(uint8_t s) {
+  static const char *names[STAGES] = {
+    "isr enter", "isr exit", "rx start", "rx queued", "dispatch", "handled", "tx queued", "tx done"
+  };
+
+  return s < STAGES ? names[s] : "?";
+}
+#endif
@@ -0,0 +1,57 @@
+#pragma once
+
+#include <stdint.h>
+
+#ifndef TRACE_CAPACITY
+#define TRACE_CAPACITY 256
+#endif
+
+/*
+ * Timestamps for following packets through the UART ISR and the main
+ * loop, kept in a ring of the last CAPACITY records. Each is stamped
+ * with CPU::cycles() (the DWT cycle counter on the target), and on the
+ * target the ring can be read with the debugger. Only built with TRACE
+ * defined; otherwise the trace() calls compile to nothing.
+ */
+class Trace {
+ public:
+  enum {CAPACITY = TRACE_CAPACITY}; // a power of 2
+
+  enum stage {
+    ISR_ENTER,
+    ISR_EXIT,
+    RX_START,  // packet indicator read from the UART
+    RX_QUEUED, // whole packet on packets_received
+    DISPATCH,  // taken by the main loop
+    HANDLED,   // and done with
+    TX_QUEUED, // given to the host controller to send
+    TX_DONE,   // last byte written to the UART
+    STAGES
+  };
+
+  struct Record {
+    uint32_t cycles;
+    uint8_t stage;
+    uint8_t indicator; // HCI packet type, if any
+    uint16_t length;   // of the packet, if known
+  };
+
+ private:
+  static Record ring[CAPACITY];
+  static uint32_t next; // records made, including those overwritten
+
+ public:
+  static void record(stage s, uint8_t indicator = 0, uint16_t length = 0);
+  static void clear() {next = 0;}
+  static uint32_t recorded() {return next;}
+
+  static uint32_t count() {return next < CAPACITY ? next : CAPACITY;}
+  static const Record &get(uint32_t i) {return ring[(next - count() + i) & (CAPACITY - 1)];} // oldest first
+  static const char *name(uint8_t s);
+};
+
+#ifdef TRACE
+#define trace(...) Trace::record(__VA_ARGS__)
+#else
+#define trace(...)
+#endif
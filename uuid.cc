@@ -1,6 +1,7 @@
 #include <stddef.h>
 
 #include "cc_stubs.h"
+#include "assert.h"
 #include "uuid.h"
 
 const uint8_t bluetooth_uuid[16] = {
@@ -17,63 +18,72 @@ static int from_hex(char c) {
   return -1;
 }
 
-UUID &UUID::operator=(uint16_t other) {
-  memcpy(data, bluetooth_uuid, sizeof(data));
-  data[13] = (uint8_t) (other >> 8);
-  data[12] = (uint8_t) (other & 0x00ff);
-  return *this;
-}
+/*
+ * Full UUIDs parsed from strings have nowhere else to live, so they're
+ * kept here. Each distinct UUID is stored once.
+ */
+enum {PARSED_UUIDS = 4};
+static uint8_t parsed_uuids[PARSED_UUIDS][UUID::LENGTH];
+static uint8_t parsed_count = 0;
 
-int UUID::compare(const UUID &u1, const UUID &u2) {
-  return memcmp(u1.data, u2.data, sizeof(UUID::data));
+static bool is_on_base(const uint8_t *bytes) {
+  return !memcmp(bytes, bluetooth_uuid, 12) && !memcmp(bytes + 14, bluetooth_uuid + 14, 2);
 }
 
-UUID::UUID(uint16_t shortened) {
-  memcpy(data, bluetooth_uuid, sizeof(bluetooth_uuid));
-  data[13] = (uint8_t) (shortened >> 8);
-  data[12] = (uint8_t) (shortened & 0x00ff);
+UUID::UUID(const uint8_t *bytes) : full(bytes), shortened(0) {
+  if (is_on_base(bytes)) {
+    full = 0;
+    shortened = bytes[12] + (bytes[13] << 8);
+  }
 }
 
-UUID::UUID(const UUID &other) {
-  for (unsigned int i=0; i < sizeof(data); ++i) data[i] = other.data[i];
-}
+UUID::UUID(const char *s) : full(0), shortened(0) {
+  uint8_t bytes[LENGTH];
 
-UUID::UUID(const char *s) {
-  for (unsigned int i=0; i < sizeof(data); ++i) data[i] = 0;
-       
-  uint8_t *p = data;
-  int hi, lo;
-
-  for (int i=0; i < 4; ++i) {
-    hi = from_hex(*s++);
-    lo = from_hex(*s++);
-    if (hi < 0 || lo < 0) return;
-    *p++ = (hi << 8) + lo;
-  }
+  // most significant digit first, so the last byte is the first one read
+  for (int i=LENGTH-1; i >= 0; --i) {
+    if (*s == '-') ++s;
 
-  if (*p++ != '-') return;
+    int hi = from_hex(*s++);
+    if (hi < 0) return;
+    int lo = from_hex(*s++);
+    if (lo < 0) return;
 
-  for (int j=0; j < 3; ++j) {
-    for (int i=0; i < 4; ++i) {
-      hi = from_hex(*s++);
-      lo = from_hex(*s++);
-      if (hi < 0 || lo < 0) return;
-      *p++ = (hi << 8) + lo;
-    }
+    bytes[i] = (hi << 4) + lo;
+  }
 
-    if (*p++ != '-') return;
+  if (is_on_base(bytes)) {
+    shortened = bytes[12] + (bytes[13] << 8);
+    return;
   }
 
-  for (int i=0; i < 6; ++i) {
-    hi = from_hex(*s++);
-    lo = from_hex(*s++);
-    if (hi < 0 || lo < 0) return;
-    *p++ = (hi << 8) + lo;
+  for (int i=0; i < parsed_count; ++i) {
+    if (!memcmp(parsed_uuids[i], bytes, LENGTH)) {
+      full = parsed_uuids[i];
+      return;
+    }
   }
+
+  assert(parsed_count < PARSED_UUIDS);
+  memcpy(parsed_uuids[parsed_count], bytes, LENGTH);
+  full = parsed_uuids[parsed_count++];
+}
+
+int UUID::compare_full(const UUID &u1, const UUID &u2) {
+  if (u1.full == 0) return -1;
+  if (u2.full == 0) return 1;
+  if (u1.full == u2.full) return 0;
+  return memcmp(u1.full, u2.full, LENGTH);
 }
 
-bool UUID::is_16bit() const {
-  return !memcmp(data, bluetooth_uuid, 12) && !memcmp(data + 14, bluetooth_uuid + 14, 2);
+void UUID::write(uint8_t *dst) const {
+  if (full) {
+    memcpy(dst, full, LENGTH);
+  } else {
+    memcpy(dst, bluetooth_uuid, LENGTH);
+    dst[12] = (uint8_t) (shortened & 0x00ff);
+    dst[13] = (uint8_t) (shortened >> 8);
+  }
 }
 
 extern const char hex_digits[16];
@@ -83,13 +93,17 @@ void to_hex(char *dst, uint8_t byte) {
   dst[1] = hex_digits[byte & 0x0f];
 }
 
-const char *UUID::pretty_print() {
+const char *UUID::pretty_print() const {
   static char buffer[40];
   char *p = buffer;
 
   if (is_16bit()) {
-    for (int i=13; i >= 12; --i, p += 2) to_hex(p, data[i]);
+    to_hex(p, shortened >> 8);
+    to_hex(p + 2, shortened & 0x00ff);
+    p += 4;
   } else {
+    const uint8_t *data = full;
+
     for (int i=15; i >= 12; --i, p += 2) to_hex(p, data[i]); *p++ = '-';
     for (int i=11; i >= 10; --i, p += 2) to_hex(p, data[i]); *p++ = '-';
     for (int i= 9; i >=  8; --i, p += 2) to_hex(p, data[i]); *p++ = '-';
@@ -3,24 +3,47 @@
 #include <stdint.h>
 #include "cc_stubs.h"
 
-struct UUID {
-  uint8_t data[16];
-
-  UUID() {}
-  UUID(const char *s); // e.g., UUID("00001234-0000-1000-8000-00805F9B34FB")
-  UUID(uint16_t shortened);
-  UUID(const UUID &other);
-
-  bool is_16bit() const;
-  UUID &operator=(const uint8_t *other) {memcpy(data, other, sizeof(data)); return *this;}
-  UUID &operator=(uint16_t other);
-  operator uint16_t() const { return data[12] + (data[13] << 8); }
-  operator uint8_t const *() const { return data; }
-  bool operator==(uint16_t other) const {return is_16bit() && (other == (uint16_t) *this);}
+/*
+ * A 16-bit UUID is stored as its value. Any other UUID refers to its 16
+ * bytes (little-endian, as they're sent over the air), which are kept
+ * by the owner, usually as a const array in flash. UUIDs on the
+ * Bluetooth base are always stored as 16 bits, so comparing against a
+ * 16-bit UUID is a single compare and never touches memory.
+ */
+class UUID {
+  const uint8_t *full; // 0 for a 16-bit UUID
+  uint16_t shortened;
+
+ public:
+  enum {LENGTH = 16}; // bytes in a full UUID
+
+  UUID() : full(0), shortened(0) {}
+
+  // usable in constant initializers
+  constexpr UUID(uint16_t s) : full(0), shortened(s) {}
+
+  UUID(const uint8_t *bytes); // LENGTH bytes, which must outlive the UUID
+  UUID(const char *s);        // e.g., UUID("f000aa00-0451-4000-b000-000000000000")
+
+  bool is_16bit() const {return full == 0;}
+  operator uint16_t() const {return shortened;} // only meaningful if is_16bit()
+  bool operator==(uint16_t other) const {return full == 0 && shortened == other;}
   bool operator!=(uint16_t other) const {return !(*this == other);}
-  bool operator==(const UUID &other) const {return 0==compare(*this, other);}
+  bool operator==(const UUID &other) const {
+    if (full == 0 || other.full == 0) return full == other.full && shortened == other.shortened;
+    return full == other.full || 0 == memcmp(full, other.full, LENGTH);
+  }
   bool operator!=(const UUID &other) const {return !(*this == other);}
-  const char *pretty_print();
 
-  static int compare(const UUID &u1, const UUID &u2);
+  void write(uint8_t *dst) const; // the full LENGTH bytes
+  const char *pretty_print() const;
+
+  // orders 16-bit UUIDs before full ones
+  static int compare(const UUID &u1, const UUID &u2) {
+    if (u1.full == 0 && u2.full == 0) return (int) u1.shortened - (int) u2.shortened;
+    return compare_full(u1, u2);
+  }
+
+ private:
+  static int compare_full(const UUID &u1, const UUID &u2);
 };
@@ -0,0 +1,432 @@
+#ifndef __arm__
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include "virtual_controller.h"
+#include "bluetooth_constants.h"
+#include "hal.h"
+
+using namespace std;
+using namespace HCI;
+
+VirtualController::VirtualController(UARTModel &u) :
+  uart(u),
+  connected_at(0),
+  waiting_for_host(false),
+  powered(true),
+  baud(115200),
+  host_baud(115200),
+  shutdown(0),
+  le_acl_length(27),
+  le_acl_packets(4),
+  command_credits(1),
+  scripted_credits(0),
+  scripted_credits_size(0),
+  unanswered_command(0),
+  connection_handle(0x0001),
+  host_flow_control(false),
+  host_acl_length(0),
+  host_acl_packets(0),
+  host_credits(0),
+  attribute_handle(0x0001),
+  request_size(3),
+  requests_per_second(0),
+  window(1),
+  limit(0),
+  discover(false),
+  discovery_start(0x0001),
+  completions_per_second(0),
+  commands(0),
+  baud_changes(0),
+  acl_from_host(0),
+  power_ups(0),
+  garbled(0),
+  requests(0),
+  responses(0),
+  errors(0),
+  max_outstanding(0),
+  flow_stalls(0),
+  notifications(0),
+  buffered(0),
+  max_buffered(0),
+  overruns(0),
+  first_notification(0),
+  last_notification(0),
+  first_request(0),
+  last_response(0)
+{
+  const uint8_t addr[6] = {0x56, 0x34, 0x12, 0xe9, 0x17, 0x00};
+  memcpy(bd_addr.data, addr, sizeof(addr));
+}
+
+// forgets everything when SHUTDOWN is released
+void VirtualController::check_power() {
+  bool on = shutdown == 0 || shutdown->get_value();
+
+  if (on && !powered) {
+    power_ups += 1;
+    baud = 115200;
+    memory.clear();
+    incoming.clear();
+    completions.clear();
+    connected_at = 0;
+    waiting_for_host = false;
+    host_flow_control = false;
+    buffered = 0;
+  }
+
+  powered = on;
+}
+
+void VirtualController::uart_received(const uint8_t *bytes, size_t length) {
+  check_power();
+
+  if (!powered || host_baud != baud) {
+    garbled += length;
+    return;
+  }
+
+  incoming.insert(incoming.end(), bytes, bytes + length);
+
+  for (;;) {
+    size_t frame;
+
+    if (incoming.size() < 4) break;
+
+    switch (incoming[0]) {
+    case COMMAND_PACKET :
+      frame = 4 + incoming[3];
+      break;
+
+    case ACL_PACKET :
+      if (incoming.size() < 5) return;
+      frame = 5 + incoming[3] + (incoming[4] << 8);
+      break;
+
+    default :
+      fprintf(stderr, "virtual controller: bad packet indicator 0x%02x\n", incoming[0]);
+      abort();
+    }
+
+    if (incoming.size() < frame) break;
+
+    const uint8_t *p = &incoming[0];
+
+    if (p[0] == COMMAND_PACKET) {
+      command(p[1] + (p[2] << 8), p + 4, p[3]);
+    } else {
+      acl((p[1] + (p[2] << 8)) & 0x0fff, p + 5, frame - 5);
+    }
+
+    incoming.erase(incoming.begin(), incoming.begin() + frame);
+  }
+}
+
+void VirtualController::uart_baud_changed(uint32_t bps) {
+  baud_changes += 1;
+  host_baud = bps;
+}
+
+void VirtualController::command(uint16_t opcode, const uint8_t *params, uint8_t length) {
+  commands += 1;
+  if (commands == unanswered_command) return;
+
+  switch (opcode) {
+  case OPCODE_RESET :
+    connected_at = 0;
+    command_complete(opcode);
+    break;
+
+  case OPCODE_READ_LOCAL_VERSION_INFORMATION : {
+    const uint8_t ret[] = {
+      SPECIFICATION_4_0, 0x00, 0x00, // HCI version, revision
+      SPECIFICATION_4_0, 0x0d, 0x00, // LMP version, manufacturer (TI)
+      0x34, 0x1b                     // LMP subversion
+    };
+    command_complete(opcode, ret, sizeof(ret));
+    break;
+  }
+
+  case OPCODE_READ_BD_ADDR :
+    command_complete(opcode, bd_addr.data, sizeof(bd_addr.data));
+    break;
+
+  case OPCODE_READ_BUFFER_SIZE_COMMAND : {
+    const uint8_t ret[] = {0xfd, 0x03, 0x00, 0x04, 0x00, 0x00, 0x00};
+    command_complete(opcode, ret, sizeof(ret));
+    break;
+  }
+
+  case OPCODE_READ_PAGE_TIMEOUT : {
+    const uint8_t ret[] = {0x00, 0x20};
+    command_complete(opcode, ret, sizeof(ret));
+    break;
+  }
+
+  case OPCODE_LE_READ_BUFFER_SIZE : {
+    const uint8_t ret[] = {(uint8_t) le_acl_length, (uint8_t) (le_acl_length >> 8), le_acl_packets};
+    command_complete(opcode, ret, sizeof(ret));
+    break;
+  }
+
+  case OPCODE_LE_READ_SUPPORTED_STATES : {
+    const uint8_t ret[] = {0xff, 0xff, 0xff, 0x1f, 0x00, 0x00, 0x00, 0x00};
+    command_complete(opcode, ret, sizeof(ret));
+    break;
+  }
+
+  case OPCODE_HOST_BUFFER_SIZE :
+    host_acl_length = params[0] + (params[1] << 8);
+    host_acl_packets = params[3] + (params[4] << 8);
+    command_complete(opcode);
+    break;
+
+  case OPCODE_SET_CONTROLLER_TO_HOST_FLOW_CONTROL :
+    host_flow_control = (params[0] & 0x01) != 0;
+    host_credits = host_acl_packets;
+    command_complete(opcode);
+    break;
+
+  case OPCODE_HOST_NUMBER_OF_COMPLETED_PACKETS :
+    // no response unless there's an error
+    for (uint8_t i=0; i < params[0]; ++i) {
+      const uint8_t *count = params + 1 + 2*params[0] + 2*i; // after the handles
+      host_credits += count[0] + (count[1] << 8);
+    }
+    break;
+
+  case OPCODE_PAN13XX_CHANGE_BAUD_RATE :
+    // answered at the old rate
+    command_complete(opcode);
+    baud = params[0] + (params[1] << 8) + (params[2] << 16) + (params[3] << 24);
+    break;
+
+  case OPCODE_WRITE_MEMORY : {
+    uint32_t address = params[0] + (params[1] << 8) + (params[2] << 16) + (params[3] << 24);
+    for (uint8_t i=0; i < params[4]; ++i) memory[address + i] = params[5 + i];
+    command_complete(opcode);
+    break;
+  }
+
+  case OPCODE_READ_MEMORY : {
+    uint32_t address = params[0] + (params[1] << 8) + (params[2] << 16) + (params[3] << 24);
+    uint8_t ret[255];
+    for (uint8_t i=0; i < params[4]; ++i) ret[i] = memory.count(address + i) ? memory[address + i] : 0;
+    command_complete(opcode, ret, params[4]);
+    break;
+  }
+
+  case OPCODE_LE_SET_ADVERTISE_ENABLE :
+    command_complete(opcode);
+    if (length > 0 && params[0] != 0 && !is_connected()) connect();
+    break;
+
+  default :
+    command_complete(opcode);
+    break;
+  }
+}
+
+void VirtualController::acl(uint16_t handle, const uint8_t *payload, uint16_t length) {
+  acl_from_host += 1;
+
+  uint64_t now = NVIC::nanoseconds();
+
+  // L2CAP length and channel precede the ATT PDU
+  if (handle == connection_handle && length > 4 && payload[2] == L2CAP::ATTRIBUTE_CID) {
+    if (payload[4] == ATT::OPCODE_HANDLE_VALUE_NOTIFICATION) {
+      if (notifications == 0) first_notification = now;
+      notifications += 1;
+      last_notification = now;
+    } else if (discover) {
+      responses += 1;
+      last_response = now;
+      discovered(payload + 4, length - 4);
+    } else {
+      if (payload[4] != ATT::OPCODE_READ_RESPONSE) errors += 1;
+      responses += 1;
+      last_response = now;
+    }
+  }
+
+  // the host must wait for a buffer to be completed before using it again
+  buffered += 1;
+  if (buffered > max_buffered) max_buffered = buffered;
+  if (buffered > le_acl_packets) overruns += 1;
+
+  if (completions_per_second == 0) {
+    complete(handle, 1);
+  } else {
+    uint64_t interval = 1000000000ULL/completions_per_second;
+    uint64_t last = completions.empty() ? now : completions.back();
+    completions.push_back((last > now ? last : now) + interval);
+  }
+}
+
+// the controller has "transmitted" count packets, so report them as completed
+void VirtualController::complete(uint16_t handle, uint16_t count) {
+  const uint8_t completed[] = {1, (uint8_t) handle, (uint8_t) (handle >> 8), (uint8_t) count, (uint8_t) (count >> 8)};
+
+  buffered -= count;
+  event(EVENT_NUMBER_OF_COMPLETED_PACKETS, completed, sizeof(completed));
+}
+
+// as the real controller answered, if the script recorded it
+uint8_t VirtualController::credits(uint16_t opcode) const {
+  for (uint32_t i=0; i + 3 <= scripted_credits_size; i += 3) {
+    if (scripted_credits[i] + (scripted_credits[i + 1] << 8) == opcode) return scripted_credits[i + 2];
+  }
+
+  return command_credits;
+}
+
+void VirtualController::command_complete(uint16_t opcode, const uint8_t *ret, uint8_t length) {
+  uint8_t params[255];
+
+  params[0] = credits(opcode); // num HCI command packets
+  params[1] = (uint8_t) opcode;
+  params[2] = (uint8_t) (opcode >> 8);
+  params[3] = SUCCESS;
+  if (length) memcpy(params + 4, ret, length);
+
+  event(EVENT_COMMAND_COMPLETE, params, 4 + length);
+}
+
+void VirtualController::event(uint8_t code, const uint8_t *params, uint8_t length) {
+  uint8_t header[] = {EVENT_PACKET, code, length};
+
+  uart.inject(header, sizeof(header));
+  uart.inject(params, length);
+}
+
+void VirtualController::connect() {
+  const uint8_t params[] = {
+    LE_EVENT_CONNECTION_COMPLETE,
+    SUCCESS,
+    (uint8_t) connection_handle, (uint8_t) (connection_handle >> 8),
+    0x01,                               // role: slave
+    0x00,                               // peer address type: public
+    0x01, 0x02, 0x03, 0x04, 0x05, 0x06, // peer address
+    0x18, 0x00,                         // interval: 30 msec
+    0x00, 0x00,                         // latency
+    0x48, 0x00,                         // supervision timeout: 720 msec
+    0x00                                // master clock accuracy
+  };
+
+  event(EVENT_LE_META_EVENT, params, sizeof(params));
+  connected_at = NVIC::nanoseconds();
+}
+
+// records the services in a Read By Group Type response, or ends discovery
+void VirtualController::discovered(const uint8_t *pdu, uint16_t length) {
+  if (pdu[0] == ATT::OPCODE_ERROR && length == 5 && pdu[4] == ATT::ATTRIBUTE_NOT_FOUND) {
+    limit = responses; // that's all of them
+    return;
+  }
+
+  if (pdu[0] != ATT::OPCODE_READ_BY_GROUP_TYPE_RESPONSE || length < 2 || pdu[1] < 6) {
+    errors += 1;
+    limit = responses;
+    return;
+  }
+
+  uint8_t entry = pdu[1];
+
+  for (uint16_t i=2; i + entry <= length; i += entry) {
+    Service s;
+    s.start = pdu[i] + (pdu[i + 1] << 8);
+    s.end = pdu[i + 2] + (pdu[i + 3] << 8);
+    s.uuid = entry == 6 ? pdu[i + 4] + (pdu[i + 5] << 8) : 0;
+
+    // each group must follow the last, or the client would go round in circles
+    if (s.start < discovery_start || s.end < s.start) {
+      errors += 1;
+      limit = responses;
+      return;
+    }
+
+    services.push_back(s);
+    discovery_start = s.end + 1;
+  }
+
+  if (discovery_start == 0) limit = responses; // the last group ended at 0xffff
+}
+
+void VirtualController::send_request() {
+  if (discover) {
+    const uint8_t request[] = {
+      ACL_PACKET,
+      (uint8_t) connection_handle, (uint8_t) (0x20 | (connection_handle >> 8)),
+      11, 0,
+      7, 0,
+      (uint8_t) L2CAP::ATTRIBUTE_CID, 0,
+      ATT::OPCODE_READ_BY_GROUP_TYPE_REQUEST,
+      (uint8_t) discovery_start, (uint8_t) (discovery_start >> 8),
+      0xff, 0xff,
+      (uint8_t) GATT::PRIMARY_SERVICE, (uint8_t) (GATT::PRIMARY_SERVICE >> 8)
+    };
+
+    uart.inject(request, sizeof(request));
+    if (requests == 0) first_request = NVIC::nanoseconds();
+    requests += 1;
+    return;
+  }
+
+  uint16_t pdu = request_size < 3 ? 3 : request_size;
+  uint16_t l2cap = 4 + pdu;
+  const uint8_t header[] = {
+    ACL_PACKET,
+    (uint8_t) connection_handle, (uint8_t) (0x20 | (connection_handle >> 8)),
+    (uint8_t) l2cap, (uint8_t) (l2cap >> 8),
+    (uint8_t) pdu, (uint8_t) (pdu >> 8),
+    (uint8_t) L2CAP::ATTRIBUTE_CID, 0,
+    ATT::OPCODE_READ_REQUEST,
+    (uint8_t) attribute_handle, (uint8_t) (attribute_handle >> 8)
+  };
+  std::vector<uint8_t> request(header, header + sizeof(header));
+
+  request.resize(sizeof(header) + (pdu - 3), 0);
+  uart.inject(&request[0], request.size());
+  if (requests == 0) first_request = NVIC::nanoseconds();
+  requests += 1;
+
+  if (requests - responses > max_outstanding) max_outstanding = requests - responses;
+}
+
+void VirtualController::poll() {
+  uint64_t now = NVIC::nanoseconds();
+  uint16_t sent = 0;
+
+  check_power();
+  if (!powered) return;
+
+  while (!completions.empty() && completions.front() <= now) {
+    completions.pop_front();
+    sent += 1;
+  }
+
+  if (sent) complete(connection_handle, sent);
+  if (!is_connected()) return;
+
+  // a discovery request depends on the last one's response
+  while (requests < limit && requests - responses < (discover ? 1 : window)) {
+    if (requests_per_second) {
+      uint64_t due = connected_at + (requests*1000000000ULL)/requests_per_second;
+      if (now < due) break;
+    }
+
+    if (host_flow_control) {
+      if (host_credits == 0) {
+        if (!waiting_for_host) flow_stalls += 1;
+        waiting_for_host = true;
+        break;
+      }
+      host_credits -= 1;
+      waiting_for_host = false;
+    }
+
+    send_request();
+  }
+}
+#endif
@@ -0,0 +1,106 @@
+#ifndef __arm__
+#pragma once
+
+#include <stdint.h>
+#include <vector>
+#include <deque>
+#include <map>
+
+#include "hal_host.h"
+#include "bd_addr.h"
+
+class IOPin;
+
+/*
+ * A stand-in for the PAN1323/CC2564 baseband on the far end of a
+ * UARTModel. It acknowledges every HCI command (answering the queries
+ * made by the cold boot, service pack and warm boot scripts), reports a
+ * central connecting once advertising is enabled, and then issues ATT
+ * read requests over that link at a configurable rate, or discovers the
+ * primary services. While its
+ * SHUTDOWN pin is low it's off, and it powers up at 115200 baud with
+ * none of the memory the service pack writes. Bytes sent at the wrong
+ * baud rate are lost. Commands the service pack recorded are answered
+ * with the Num_HCI_Command_Packets it recorded, which is mostly zero.
+ */
+class VirtualController : public UARTPeer {
+  UARTModel &uart;
+  std::vector<uint8_t> incoming;
+  uint64_t connected_at;
+  bool waiting_for_host;
+  std::deque<uint64_t> completions; // when each packet from the host is sent
+  bool powered;
+  uint32_t baud, host_baud;
+  std::map<uint32_t, uint8_t> memory; // written by HCI_VS_Write_Memory
+
+  void command(uint16_t opcode, const uint8_t *params, uint8_t length);
+  void acl(uint16_t handle, const uint8_t *payload, uint16_t length);
+  void command_complete(uint16_t opcode, const uint8_t *ret = 0, uint8_t length = 0);
+  void event(uint8_t code, const uint8_t *params, uint8_t length);
+  void connect();
+  void send_request();
+  void discovered(const uint8_t *pdu, uint16_t length);
+  void complete(uint16_t handle, uint16_t count);
+  void check_power();
+  uint8_t credits(uint16_t opcode) const;
+
+ public:
+  IOPin *shutdown; // if 0, the controller is always on
+
+  // controller properties reported to the host
+  BD_ADDR bd_addr;
+  uint16_t le_acl_length;
+  uint8_t le_acl_packets;
+  uint8_t command_credits; // commands the host may send at once
+  const uint8_t *scripted_credits; // opcode (2 bytes) and credits (1), as recorded
+  uint32_t scripted_credits_size;
+  uint32_t unanswered_command; // this one (counting from 1) is ignored, to stall a boot script
+  uint16_t connection_handle;
+
+  // controller to host flow control, as set up by the host
+  bool host_flow_control;
+  uint16_t host_acl_length, host_acl_packets;
+  uint16_t host_credits; // ACL packets the host can take now
+
+  // ATT load generated once connected
+  uint16_t attribute_handle;
+  uint16_t request_size;        // ATT PDU length, padded after the handle
+  uint32_t requests_per_second; // 0 means as fast as the window allows
+  uint32_t window;              // outstanding requests
+  uint32_t limit;               // total requests
+
+  /*
+   * Or, instead of the reads, discover the primary services one Read By
+   * Group Type request at a time, as a GATT client would.
+   */
+  struct Service {
+    uint16_t start, end, uuid; // uuid is 0 if it's 128 bits
+  };
+  bool discover;
+  uint16_t discovery_start;      // of the next request
+  std::vector<Service> services; // found so far
+
+  // ACL packets from the host leave the controller's buffers at this
+  // rate, or as soon as they arrive if it's 0
+  uint32_t completions_per_second;
+
+  // statistics
+  uint32_t commands, baud_changes, acl_from_host;
+  uint32_t power_ups, garbled; // bytes sent while off or at the wrong baud
+  uint32_t requests, responses, errors, max_outstanding;
+  uint32_t flow_stalls; // times a request waited for the host to free a packet
+  uint32_t notifications;
+  uint32_t buffered, max_buffered, overruns; // ACL packets from the host
+  uint64_t first_notification, last_notification; // nsec
+  uint64_t first_request, last_response; // nsec
+
+  VirtualController(UARTModel &u);
+
+  bool is_connected() const {return connected_at != 0;}
+  bool is_finished() const {return responses >= limit;}
+
+  virtual void uart_received(const uint8_t *bytes, size_t length);
+  virtual void uart_baud_changed(uint32_t bps);
+  virtual void poll();
+};
+#endif